@@ -41,7 +41,13 @@ public:
 
 	void ToggleMute();
 
+	//io handlers for the sound registers and wave ram, FF10-FF3F. Registered with the mmu
+	static uint8_t ReadRegister(void* apu, uint16_t addr);
+	static void WriteRegister(void* apu, uint16_t addr, uint8_t val);
+
 private:
+
+	std::array<uint8_t, 0x30> registers = { 0 }; //FF10-FF3F as last written, for reading back
 	
 	uint16_t duty_waveforms[32] = {	0, 0, 0, 0, 0, 0, 1, 0,
 									0, 0, 0, 0, 0, 0, 1, 1,
@@ -0,0 +1,105 @@
+#pragma once
+#include <stdint.h>
+#include <array>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "Mmu.h"
+
+//A single pre-decoded instruction
+struct MicroOp
+{
+	uint16_t pc = 0;      //address of the opcode byte
+	uint8_t opcode = 0;
+	uint8_t length = 0;   //instruction length in bytes, including the opcode
+	uint8_t imm[2] = { 0 }; //the bytes following the opcode (the sub-op for CB prefixed instructions)
+};
+
+//A run of straight-line code, ending at the first jump, call, return, halt or stop
+struct CodeBlock
+{
+	uint32_t key = 0; //physical location of the first opcode, see Mmu::GetCodeKey
+	bool valid = false;
+	std::vector<MicroOp> ops;
+
+	bool idleLoop = false;      //the block is a loop that only polls an io register, see Cpu::SkipIdleLoop
+};
+
+//Decodes code once per physical location and hands the cpu pre-fetched opcodes and operands.
+//ROM blocks live until a bank switch maps them out (and come back when it's mapped in again),
+//blocks in WRAM, HRAM and cart RAM are thrown away whenever the game writes to the 256 byte page they were decoded from.
+//Execution still happens one instruction at a time so timing, interrupts and DMA are unaffected.
+class BlockCache
+{
+public:
+	BlockCache(Mmu* __mmu);
+
+	//returns the decoded instruction at pc, or nullptr if it has to be fetched from the mmu as normal
+	const MicroOp* Fetch(uint16_t pc);
+
+	void Flush();
+
+	//the block whose first op was just returned by Fetch, or nullptr if Fetch continued an earlier block
+	CodeBlock* EnteredBlock();
+	//forget the current position, for when the cpu has moved on without going through Fetch
+	void Leave();
+
+private:
+	Mmu* mmu;
+
+	const size_t MaxBlockOps = 64;
+
+	std::unordered_map<uint32_t, std::unique_ptr<CodeBlock>> blocks;
+	std::array<std::vector<CodeBlock*>, 0x200> ramBlocks; //the valid blocks touching each page of ram, indexed like Mmu::codePages
+	std::array<CodeBlock*, 0x10000> lastBlockAt; //the block last entered at each address, checked against its key before reuse
+
+	CodeBlock* current = nullptr; //the block being executed and the next op in it
+	size_t nextIndex = 0;
+
+	uint32_t mapGeneration = 0;
+
+	CodeBlock* Lookup(uint16_t pc);
+	void Decode(CodeBlock* block, uint16_t pc);
+	void InvalidateCodePage(uint16_t codePage);
+	bool IsIdleLoop(const CodeBlock* block);
+
+	//instruction lengths in bytes, indexed by opcode. STOP is treated as 1 byte, the cpu skips its padding byte itself
+	const uint8_t OpLength[256] = {
+	 1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,
+	 1, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+	 2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+	 2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+	 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+	 1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,
+	 2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+	 2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+	};
+
+	//opcodes that end a block: anything that can change PC other than by falling through, plus halt, stop and the undefined ops
+	const bool EndsBlock[256] = {
+	 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,
+	 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,
+	 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,
+	 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	 1, 0, 1, 1, 1, 0, 0, 1, 1, 1, 1, 0, 1, 1, 0, 1,
+	 1, 0, 1, 1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1,
+	 0, 0, 0, 1, 1, 0, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1,
+	 0, 0, 0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 1, 1, 0, 1,
+	};
+};
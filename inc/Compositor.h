@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include "Config.h"
+
+#if KGB_SIMD && (defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__))
+#define KGB_SIMD_X86 1
+#else
+#define KGB_SIMD_X86 0
+#endif
+
+//Merges the two layers the ppu draws each line into: the background/window and the sprites. Every pixel that
+//decides between the two is independent of its neighbours, so a whole line is done 16 or 32 pixels at a time with
+//SSE2/AVX2, whichever the cpu has. The scalar versions are the reference the vector ones have to match bit for bit.
+//
+//Each layer is one byte per pixel:
+//background  bits 0-1 colour, bits 2-4 cgb palette, bit 7 set if the tile has priority over sprites
+//sprites     bits 0-1 colour, bits 2-4 cgb palette, bit 5 set to use the sprite half of the colour table,
+//            bit 6 set if a sprite has an opaque pixel here, bit 7 set if a sprite at or above it is behind the background
+//The colour bits are whatever the caller wants to see come out the other end (dmg shades, or cgb colour indexes),
+//only the background's has to be the raw colour index (or dmg shade) since colour 0 never covers sprites.
+class Compositor
+{
+public:
+	enum PATH { SCALAR = 0, SSE2, AVX2 };
+
+	static const int LINE_WIDTH = 160;
+
+	static const uint8_t BG_PRIORITY = 0x80;
+	static const uint8_t OBJ_BEHIND_BG = 0x80;
+	static const uint8_t OBJ_OPAQUE = 0x40;
+	static const uint8_t OBJ_TABLE = 0x20;
+
+	Compositor();
+
+	//pick the background or sprite byte for each pixel and write it out anded with mask. out can be the bg buffer.
+	//masterPriority lets the background cover sprites at all (lcdc bit 0 on cgb, always on for dmg)
+	void Compose(const uint8_t* bg, const uint8_t* obj, bool masterPriority, uint8_t mask, uint8_t* out);
+
+	//look the composed line's bytes up in a 64 entry RGBA table
+	void Colorize(const uint8_t* codes, const uint32_t* colors, uint32_t* out);
+
+	//dmg output: look each pixel's pair of shades, last frame's and this one's, up in a 16 entry RGBA table indexed
+	//by (previous << 2) | current
+	void ColorizePairs(const uint8_t* previous, const uint8_t* current, const uint32_t* pairColors, uint32_t* out);
+
+	PATH GetPath() { return path; }
+
+private:
+	PATH path = SCALAR;
+
+	static void ComposeScalar(const uint8_t* bg, const uint8_t* obj, bool masterPriority, uint8_t mask, uint8_t* out);
+	static void ColorizeScalar(const uint8_t* codes, const uint32_t* colors, uint32_t* out);
+	static void ColorizePairsScalar(const uint8_t* previous, const uint8_t* current, const uint32_t* pairColors, uint32_t* out);
+#if KGB_SIMD_X86
+	static void ComposeSSE2(const uint8_t* bg, const uint8_t* obj, bool masterPriority, uint8_t mask, uint8_t* out);
+	static void ComposeAVX2(const uint8_t* bg, const uint8_t* obj, bool masterPriority, uint8_t mask, uint8_t* out);
+	static void ColorizeAVX2(const uint8_t* codes, const uint32_t* colors, uint32_t* out);
+	static void PairCodesSSE2(const uint8_t* previous, const uint8_t* current, uint8_t* out);
+#endif
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+//Build time switches. Each one can be overridden from the project's preprocessor definitions, e.g. KGB_TABLE_DISPATCH=0
+
+//CPU opcode dispatch engine
+//1 = per-opcode handler tables (see CpuOps.cpp)
+//0 = the original switch statement in Cpu::Execute
+#ifndef KGB_TABLE_DISPATCH
+#define KGB_TABLE_DISPATCH 1
+#endif
+
+//Decoded block cache for the CPU (see BlockCache.h)
+//1 = fetch opcodes and operands from pre-decoded blocks, keyed by the physical rom/ram they came from
+//0 = fetch every byte through the mmu
+#ifndef KGB_BLOCK_CACHE
+#define KGB_BLOCK_CACHE 1
+#endif
+
+//Lazy flag evaluation (see SetFlagsResult in CpuOps.cpp). Needs the handler tables, the switch in Cpu::Execute works on the flags struct directly
+//1 = ALU ops record their result and carry bits, Z/N/H/C are only worked out when read
+//0 = every op writes the flags struct and Regs.F straight away
+#ifndef KGB_LAZY_FLAGS
+#define KGB_LAZY_FLAGS 1
+#endif
+
+#if KGB_LAZY_FLAGS && !KGB_TABLE_DISPATCH
+#error KGB_LAZY_FLAGS requires KGB_TABLE_DISPATCH
+#endif
+
+//Event scheduler (see Scheduler.h)
+//1 = the ppu, mmu and timers are only updated when they next have something to do, or when the game touches their registers
+//0 = update them after every instruction
+#ifndef KGB_SCHEDULER
+#define KGB_SCHEDULER 1
+#endif
+
+//Idle loop skipping (see Cpu::SkipIdleLoop). Needs the block cache to find the loops and the scheduler to know how long they'll spin for
+//1 = loops that just poll LY, STAT or IF skip ahead to the next point the value could change
+//0 = run every pass of the loop
+#ifndef KGB_IDLE_LOOPS
+#define KGB_IDLE_LOOPS 1
+#endif
+
+#if KGB_IDLE_LOOPS && !(KGB_BLOCK_CACHE && KGB_SCHEDULER)
+#error KGB_IDLE_LOOPS requires KGB_BLOCK_CACHE and KGB_SCHEDULER
+#endif
+
+//SIMD scanline compositor (see Compositor.h). x86 only, falls back to the scalar version anywhere else
+//1 = merge the background and sprite layers with SSE2 or AVX2, whichever the cpu supports
+//0 = scalar only
+#ifndef KGB_SIMD
+#define KGB_SIMD 1
+#endif
+
+//Run the scalar compositor alongside the SIMD one and report any line where they differ. On by default in debug builds
+#ifndef KGB_SIMD_SELF_CHECK
+#ifdef _DEBUG
+#define KGB_SIMD_SELF_CHECK 1
+#else
+#define KGB_SIMD_SELF_CHECK 0
+#endif
+#endif
+
+//When the ppu draws each line (see Ppu::RenderLine)
+//0 = as soon as the line reaches hblank
+//1 = log each line's registers and sprites, along with every VRAM write, and draw the whole frame from the log at vblank
+//2 = hand each line to a render thread as it's captured, the frame only has to be finished by vblank. Falls back to 1
+//    if the thread can't be started
+#ifndef KGB_PPU_RENDERER
+#define KGB_PPU_RENDERER 0
+#endif
+
+//Run emulation on its own thread (see FrameExchange.h). Only with audio on, without it the vsync'd present at vblank is
+//what keeps emulation running at the right speed, so everything stays on the main thread
+//1 = the cpu, ppu and apu run on a thread started by main, and the ppu publishes each finished frame. Main keeps the
+//    renderer, since SDL wants rendering done on the main thread, and only presents the newest frame and passes input
+//    on. A slow present drops frames instead of holding up emulation or audio
+//0 = the ppu uploads and presents every frame itself at vblank, on the main thread
+#ifndef KGB_EMULATION_THREAD
+#define KGB_EMULATION_THREAD 1
+#endif
+
+//Texture the frames are shown from
+//1 = streaming texture, the ppu writes each finished frame straight into the texture's memory
+//0 = render target texture, filled from a copy of the frame with SDL_UpdateTexture
+#ifndef KGB_STREAMING_TEXTURE
+#define KGB_STREAMING_TEXTURE 1
+#endif
+
+//Skip frames that haven't changed (see Ppu::FindChangedLines)
+//1 = only the lines that changed since the last frame are uploaded, and unchanged frames aren't uploaded at all. They're
+//    still presented from the texture, since that's what paces emulation without audio, but aren't published to main
+//0 = upload and present every frame in full
+#ifndef KGB_SKIP_UNCHANGED_FRAMES
+#define KGB_SKIP_UNCHANGED_FRAMES 1
+#endif
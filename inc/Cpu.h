@@ -2,7 +2,12 @@
 #include "Mmu.h"
 #include "Ppu.h"
 #include "Apu.h"
+#include "Config.h"
+#include "BlockCache.h"
+#include "Scheduler.h"
 #include <stdint.h>
+#include <array>
+#include <utility>
 #include <sstream>
 #include "Stopwatch.h"
 
@@ -104,6 +109,17 @@ private:
 		uint8_t carry{ 0 };
 	} flags;
 
+#if KGB_LAZY_FLAGS
+	//with lazy flags the handlers only record this, and flags/Regs.F are left stale. GetF rebuilds F
+	struct {
+		uint8_t result{ 1 };     //Z is set when this is 0
+		uint8_t negative{ 0 };
+		uint16_t carryBits{ 0 }; //H in bit 4, C in bit 8
+	} lazyFlags;
+#endif
+
+	uint8_t GetF();
+
 	void SetZero(int newVal);
 	void SetNeg(int newVal);
 	void SetHalfCarry(int newVal);
@@ -136,11 +152,8 @@ private:
 	uint64_t FrameCyclesCounter{ 0 };
 	uint64_t OpsCounter{ 0 };
 
-	uint64_t div_cycles{ 0 };
-	uint64_t timer_cycles{ 0 };
-	const uint16_t timer_cycle_thresholds[4] = { 1024, 16, 64, 256 };
-
 	void UpdateTimers(uint16_t cycles);
+	void AdvanceTimers(uint16_t cycles);
 
 	//the minimum amount of t-cycles each operation takes. 
 	//for variable-time ops, the extra time needs to be added by the op
@@ -184,6 +197,106 @@ private:
 
 	void UpdatePpu();
 	void UpdateMmu();
+	void FinishInstruction();
+
+#if KGB_SCHEDULER
+	Scheduler scheduler;
+	static void SchedulerSync(void* cpu);
+	uint64_t CatchUpPpuMmu();
+	void CatchUp();
+	void ScheduleEvents();
+	uint64_t HaltedTicksToSkip();
+#endif
+
+#if KGB_IDLE_LOOPS
+	bool SkipIdleLoop();
+#endif
+
+	//table driven dispatch. Handlers are defined in CpuOps.cpp
+	//register operands use the opcode encoding: 0=B 1=C 2=D 3=E 4=H 5=L 6=(HL) 7=A
+	//register pairs: 0=BC 1=DE 2=HL 3=SP (3=AF for push/pop)
+	//conditions: 0=NZ 1=Z 2=NC 3=C 4=always
+	typedef void (Cpu::*OpHandler)();
+	static const std::array<OpHandler, 256> OpTable;
+	static const std::array<OpHandler, 256> CBTable;
+
+	template<uint8_t op> static constexpr OpHandler DecodeOp();
+	template<uint8_t op> static constexpr OpHandler DecodeCB();
+	template<size_t... ops> static constexpr std::array<OpHandler, sizeof...(ops)> BuildOpTable(std::index_sequence<ops...>);
+	template<size_t... ops> static constexpr std::array<OpHandler, sizeof...(ops)> BuildCBTable(std::index_sequence<ops...>);
+
+	template<uint8_t r> uint8_t GetR8();
+	template<uint8_t r> void SetR8(uint8_t val);
+	template<uint8_t p> uint16_t& R16();
+	template<uint8_t cc> bool CheckCondition();
+
+	//operand fetch. Reads from the current micro-op when the instruction came from the block cache
+	const uint8_t* immediates = nullptr;
+	uint8_t ReadImm8();
+	uint16_t ReadImm16();
+
+	void SetFlagsZNHC(uint8_t z, uint8_t n, uint8_t h, uint8_t c);
+	void SetFlagsResult(uint8_t result, uint8_t n, uint16_t carryBits);
+	void SetFlagsKeepZ(uint8_t n, uint16_t carryBits);
+	uint8_t FlagZ();
+	uint8_t FlagN();
+	uint8_t FlagH();
+	uint8_t FlagC();
+	uint8_t AddSub8(uint8_t OpA, uint8_t OpB, uint8_t inputCarryBit, bool subtraction);
+
+	void Op_NOP();
+	void Op_STOP();
+	void Op_HALT();
+	void Op_DI();
+	void Op_EI();
+	void Op_DAA();
+	void Op_CPL();
+	void Op_SCF();
+	void Op_CCF();
+	template<uint8_t y> void Op_RotA();
+
+	template<uint8_t r> void Op_LD_r_n();
+	template<uint8_t dst, uint8_t src> void Op_LD_r_r();
+	template<uint8_t p> void Op_LD_ind_A();
+	template<uint8_t p> void Op_LD_A_ind();
+	void Op_LDH_n_A();
+	void Op_LDH_C_A();
+	void Op_LD_nn_A();
+	void Op_LDH_A_n();
+	void Op_LDH_A_C();
+	void Op_LD_A_nn();
+
+	template<uint8_t p> void Op_LD_rr_nn();
+	template<uint8_t p> void Op_PUSH();
+	template<uint8_t p> void Op_POP();
+	void Op_LD_nn_SP();
+	void Op_LD_HL_SPi8();
+	void Op_LD_SP_HL();
+
+	template<uint8_t r> void Op_INC_r();
+	template<uint8_t r> void Op_DEC_r();
+	template<uint8_t alu, uint8_t r> void Op_ALU();
+	template<uint8_t p> void Op_INC_rr();
+	template<uint8_t p> void Op_DEC_rr();
+	template<uint8_t p> void Op_ADD_HL_rr();
+	void Op_ADD_SP_i8();
+
+	template<uint8_t cc> void Op_JR();
+	template<uint8_t cc> void Op_JP();
+	template<uint8_t cc> void Op_CALL();
+	template<uint8_t cc> void Op_RET();
+	void Op_RETI();
+	void Op_JP_HL();
+	template<uint8_t n> void Op_RST();
+	template<uint8_t op> void Op_Undefined();
+
+	void Op_CB();
+	template<uint8_t y, uint8_t r> void Op_CB_Rot();
+	template<uint8_t b, uint8_t r> void Op_CB_BIT();
+	template<uint8_t b, uint8_t r> void Op_CB_RES();
+	template<uint8_t b, uint8_t r> void Op_CB_SET();
+
+	BlockCache blockCache;
 
 	double throttle = 1.0;
 };
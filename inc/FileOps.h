@@ -2,6 +2,7 @@
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <stdint.h>
 namespace fs = std::filesystem;
 
 inline bool FileExists(const std::string& filename)
@@ -44,4 +45,9 @@ inline std::string NewFileExtension(const std::string& filename, const std::stri
     filepath.replace_extension(extension);
     std::string return_string = filepath.string();
     return return_string;
-}
\ No newline at end of file
+}
+
+//Map a whole file into memory read only. The pages come straight from the OS file cache, so nothing is copied
+//and every process mapping the same file shares one copy. Returns nullptr on failure
+const uint8_t* MapFile(const std::string& filename, size_t& size);
+void UnmapFile(const uint8_t* data, size_t size);
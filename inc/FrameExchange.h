@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+//Hands finished frames from the ppu on the emulation thread to main, which shows them, without either thread ever waiting
+//on the other. There are three buffers: the ppu always has one to draw into, main always has one to read from, and the
+//third holds the newest finished frame. Publishing swaps the ppu's buffer with the middle one and taking the newest swaps
+//main's with it, so main always gets the latest frame and any it was too slow for are dropped
+class FrameExchange
+{
+public:
+	static const int WIDTH = 160;
+	static const int HEIGHT = 144;
+
+	FrameExchange();
+
+	//ppu side: the buffer to draw the next frame into, the same one until Publish
+	uint32_t* GetBackBuffer();
+	void Publish();
+
+	//main's side: the newest frame if one has been published since the last call, otherwise nullptr.
+	//Stays valid until the next call
+	const uint32_t* TakeLatest();
+
+private:
+	static const uint8_t FRESH = 0x80;
+
+	uint32_t buffers[3][WIDTH * HEIGHT];
+	uint8_t back{ 0 };  //only touched by the ppu
+	uint8_t front{ 1 }; //only touched by main
+	//which buffer is in the middle, with FRESH set if it's a frame main hasn't taken yet
+	std::atomic<uint8_t> middle{ 2 };
+};
@@ -6,16 +6,21 @@
 #include "FileOps.h"
 #include "Apu.h"
 #include "Serial.h"
+#include "Config.h"
+#include "Scheduler.h"
+#include "Timer.h"
+#include "TileCache.h"
 
 class Mmu
 {
 public:
 	Mmu(Apu* __apu, Serial* __lc);
+	~Mmu();
 	uint8_t		ReadByte(uint16_t addr);
 	void		WriteByte(uint16_t addr, uint8_t val);
 	uint16_t	ReadWord(uint16_t addr);
 	void		WriteWord(uint16_t addr, uint16_t val);
-	uint8_t*	GetROM();
+	bool		LoadRom(const std::string& romFileName);
 	uint8_t*	GetDMGBootRom();
 	uint8_t*    GetCGBBootRom();
 
@@ -24,9 +29,27 @@ public:
 	bool		GetCGBSupport();
 
 	uint8_t		ReadVRAMDirect(uint16_t addr, uint8_t bank);
+	uint8_t		GetVRAMBank();
+	const std::array<std::array<uint8_t, 0x2000>, 2>& GetVRAM();
+
+	//While a journal is set every write to VRAM, by the cpu or either dma, is also appended to it as
+	//(bank << 21) | (offset << 8) | value, so the ppu can bring its own copy of VRAM up to date later on
+	void		SetVRAMJournal(std::vector<uint32_t>* journal);
 
 	uint32_t	GetBGPColor(uint8_t paletteNum, uint8_t index);
 	uint32_t	GetOBPColor(uint8_t paletteNum, uint8_t index);
+	//all 64 cgb colours as RGBA, the 8 background palettes of 4 colours then the 8 sprite palettes
+	const uint32_t* GetPaletteColors();
+
+	//how cgb colours are turned into RGBA
+	enum COLOR_CORRECTION {
+		COLOR_RAW = 0,    //each 5 bit channel scaled straight up to 8 bits
+		COLOR_LCD,        //mixes the channels and dims them like the cgb's lcd
+		COLOR_LCD_BRIGHT, //the same idea, but lighter and less washed out
+		COLOR_CORRECTION_COUNT
+	};
+	void SetColorCorrection(COLOR_CORRECTION mode);
+	COLOR_CORRECTION GetColorCorrection();
 
 	void Tick(uint16_t cycles);
 
@@ -50,12 +73,14 @@ public:
 
 	//void SaveDiv(uint8_t val);
 	//void SaveStat(uint8_t val);
-	//uint16_t master_clock{ 0x00 };
-	uint16_t master_clock{ 0xDC88 }; //TODO: set this to 0 once the bootrom PPU timing is correct
+	//Timer timer{ 0x00 };
+	Timer timer{ 0xDC88 }; //TODO: start the divider at 0 once the bootrom PPU timing is correct
+	TileCache tileCache{ VRAM };
 	uint16_t rtc_clock = 0;
 	uint32_t rtc_ticks = 0;
 
 	uint8_t currentPPUMode{ 0 };
+	bool oamChanged{ true }; //set on every write to OAM, the ppu clears it once it has decoded the sprites again
 
 	struct {
 		uint8_t buttons{ 0x0F };
@@ -77,6 +102,32 @@ public:
 
 	void RegisterApu(Apu* which);
 
+	//Handlers for the io registers at FF00-FF7F, one read and one write per register. Subsystems register the ones they
+	//own and get user passed back. Reads have the register's unused bits set afterwards, so handlers don't need to
+	typedef uint8_t (*IoReadHandler)(void* user, uint16_t addr);
+	typedef void (*IoWriteHandler)(void* user, uint16_t addr, uint8_t val);
+	void RegisterIoHandler(uint16_t addr, IoReadHandler read, IoWriteHandler write, void* user);
+
+	//interrupts that are both requested in IF and enabled in IE. Kept up to date on every write to either
+	uint8_t pendingInterrupts = 0;
+
+	void RegisterScheduler(Scheduler* which);
+	//how many cycles until Tick next has something to do besides counting cycles
+	uint64_t CyclesUntilNextEvent();
+
+	//Support for the cpu's decoded block cache, see BlockCache.h
+	//Code is identified by a key into the physical rom/ram it was read from rather than its address, so banked code can be cached
+	static const uint32_t CODEKEY_WRAM    = 0x800000; //keys below this are rom offsets
+	static const uint32_t CODEKEY_HRAM    = 0x808000;
+	static const uint32_t CODEKEY_CARTRAM = 0x810000;
+
+	uint32_t mapGeneration = 0; //bumped whenever a bank switch or boot rom unmap changes what is mapped into the address space
+	//ram pages holding cached code that have been written since the block cache last looked, indexed like codePages
+	std::vector<uint16_t> writtenCodePages;
+
+	bool GetCodeKey(uint16_t addr, uint32_t& key);
+	void MarkCodePage(uint32_t key);
+
 private:
 	bool cgbMode = false;
 	bool cgbSupport = false;
@@ -116,7 +167,15 @@ private:
 	uint8_t DMGBootROM[0x100] = { 0 };
 	uint8_t CGBBootROM[0x900] = { 0 };
 
-	uint8_t ROM[0x800000] = { 0 }; //8 MB, the max CGB rom size. Probably excessive but it should always work.
+	//The cartridge rom, mapped read only from the file so it isn't copied and is shared between instances running the
+	//same game. romCopy only holds it when the file is short and had to be padded out to the size in its header
+	static const uint8_t EmptyRom[0x8000];
+	const uint8_t* ROM = EmptyRom;
+	size_t romSize = sizeof(EmptyRom);
+	const uint8_t* mappedRom = nullptr;
+	size_t mappedRomSize = 0;
+	std::vector<uint8_t> romCopy;
+	void PadRom(size_t size);
 
 	uint8_t Memory[0x10000] = { 0 }; //the currently active mapped memory
 
@@ -142,17 +201,94 @@ private:
 	void WriteMBC3(uint16_t addr, uint8_t val);
 	void WriteMBC5(uint16_t addr, uint8_t val);
 
+	//The cartridge accesses the page table can't take (mbc registers, rtc registers, disabled cart ram, MBC2's 4 bit
+	//ram), specialised for each mbc so they don't have to switch on it. ParseRomHeader picks the cart's versions once
+	template<MBC_TYPE mbc> void WriteMBC(uint16_t addr, uint8_t val);
+	template<MBC_TYPE mbc> uint8_t ReadCartArea(uint16_t addr);
+	template<MBC_TYPE mbc> void WriteCartArea(uint16_t addr, uint8_t val);
+	template<MBC_TYPE mbc> bool GetCartRamOffset(uint16_t addr, uint16_t& offset);
+	template<MBC_TYPE mbc> void UseMBC();
+
+	void (Mmu::*writeMBC)(uint16_t addr, uint8_t val) = nullptr;
+	uint8_t (Mmu::*readCartArea)(uint16_t addr) = nullptr;
+	void (Mmu::*writeCartArea)(uint16_t addr, uint8_t val) = nullptr;
+	bool (Mmu::*getCartRamOffset)(uint16_t addr, uint16_t& offset) = nullptr;
+
+	//where the fixed and switchable rom banks currently start in ROM. Updated along with the page table
+	uint32_t romBank0Offset = 0;
+	uint32_t romBankNOffset = 0x4000;
+
 
 	//ad hoc cgb stuff
-	std::array<uint8_t, 64> cgb_BGP;
-	std::array<uint8_t, 64> cgb_OBP;
+	std::array<uint8_t, 64> cgb_BGP = { 0 };
+	std::array<uint8_t, 64> cgb_OBP = { 0 };
+
+	//the palettes above as RGBA, updated as BGPD/OBPD are written. Laid out the same as GetPaletteColors
+	std::array<uint32_t, 64> cgbColors = { 0 };
+	//RGBA for every 15 bit colour in the current correction mode
+	std::array<uint32_t, 0x8000> colorLUT;
+	COLOR_CORRECTION colorCorrection = COLOR_LCD;
+	void UpdatePaletteColor(bool sprite, uint8_t index);
 
 	uint8_t currentVRAMBank = 0;
 	uint8_t currentWRAMBank = 1;
 	std::array<std::array<uint8_t, 0x2000>, 2> VRAM;
+	std::vector<uint32_t>* vramJournal = nullptr;
+	void JournalVRAM(uint8_t bank, uint16_t offset, uint16_t length)
+	{
+		if (vramJournal)
+		{
+			for (uint16_t i = 0; i < length; i++)
+				vramJournal->push_back(((uint32_t)bank << 21) | (((uint32_t)(offset + i) & 0x1FFF) << 8) | VRAM[bank][offset + i]);
+		}
+	}
 	std::array<std::array<uint8_t, 0x1000>, 8> WRAM;
 
 	Apu* apu = nullptr;
 	Serial* linkCable = nullptr;
+	Scheduler* scheduler = nullptr;
+
+	bool IsTimedAddress(uint16_t addr);
+
+	struct IoHandler {
+		IoReadHandler read;
+		IoWriteHandler write;
+		void* user;
+	};
+	std::array<IoHandler, 0x80> ioHandlers;
+	static const std::array<uint8_t, 0x80> IoReadMask;
+
+	//the registers the mmu handles itself
+	static uint8_t ReadIoMemory(void* mmu, uint16_t addr);
+	static void WriteIoMemory(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteIoReadOnly(void* mmu, uint16_t addr, uint8_t val);
+	static uint8_t ReadJoypad(void* mmu, uint16_t addr);
+	static void WriteJoypad(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteSerial(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteIF(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteSoundNoApu(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteSTAT(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteDMA(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteKEY1(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteVBK(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteBootRomDisable(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteHDMA(void* mmu, uint16_t addr, uint8_t val);
+	static uint8_t ReadPaletteData(void* mmu, uint16_t addr);
+	static void WritePaletteData(void* mmu, uint16_t addr, uint8_t val);
+	static void WriteSVBK(void* mmu, uint16_t addr, uint8_t val);
+
+	void UpdatePendingInterrupts();
+
+	std::array<uint8_t, 0x200> codePages = { 0 }; //one flag per 256 byte page of wram, hram and cart ram, set while the page holds cached code
+	void CheckCodeWrite(uint32_t key);
+
+	//Host memory behind each 256 byte page of the address space, for the plain rom and ram reads and writes that make up
+	//most accesses. nullptr means the page needs the full mapping logic (boot rom edges, oam, io, mbc registers, rtc,
+	//disabled cart ram, ram holding cached code). Rebuilt by UpdatePageTable whenever the mapping changes, and patched by
+	//UpdateCodePageWrites when a ram page starts or stops holding cached code
+	std::array<const uint8_t*, 0x100> readPages = { nullptr };
+	std::array<uint8_t*, 0x100> writePages = { nullptr };
+	void UpdatePageTable();
+	void UpdateCodePageWrites(uint16_t codePage);
 };
 
@@ -1,16 +1,36 @@
 #pragma once
 #include <iostream>
 #include <array>
+#include <vector>
+#include <atomic>
 #include "Mmu.h"
+#include "Compositor.h"
+#include "SpscQueue.h"
+#include "FrameExchange.h"
 #include <SDL.h>
 class Ppu
 {
 public:
 	Ppu(Mmu* __mmu, SDL_Texture* tex, SDL_Renderer* rend);
+	~Ppu();
 	void Tick(uint16_t cycles);
+	//how many cpu cycles until Tick next changes mode or line. Ticks before then only count cycles
+	uint64_t CyclesUntilNextEvent();
 	uint8_t* GetFramebuffer();
 	uint32_t* GetColorFrameBuffer();
+	//publish finished frames here for another thread to present instead of presenting them at vblank
+	void SetFrameExchange(FrameExchange* exchange);
+	//dmg only: average each frame with the one before, like the lcd's slow response. On by default
+	void SetFrameBlending(bool enable);
+	bool GetFrameBlending();
+	//whether the frame at the last vblank was the same as the one before, and so wasn't uploaded or published again
+	bool IsFrameUnchanged();
+	//have the next frame shown in full even if nothing changed, e.g. after the window was covered up
+	void RefreshFrame();
 	bool newFrame{ true };
+
+	//when lines get drawn, see KGB_PPU_RENDERER in Config.h
+	enum RENDER_MODE { RENDER_HBLANK = 0, RENDER_VBLANK, RENDER_WORKER };
 private:
 	Mmu* mmu;
 	uint64_t PpuCycles{ 0 };
@@ -46,21 +66,15 @@ private:
 	void SetLine(uint8_t line);
 	void CheckLYC();
 
-	void RenderLine();
-
-	void RenderLineDMG();
-
-	void RenderLineCGB();
-
-	void RenderFrame();
 
 	void SpriteSearch();
 
+	void DecodeOAM();
+
 	uint8_t FrameBuffer[160 * 144] = { 0 };
 	uint8_t WorkingFrameBuffer[160 * 144] = { 0 };
 
 	uint32_t ColorFrameBuffer[160 * 144] = { 0 };
-	uint32_t PrevColorFrameBuffer[160 * 144] = { 0 };
 	uint32_t WorkingColorFrameBuffer[160 * 144] = { 0 };
 
 	struct Sprite {
@@ -83,17 +97,108 @@ private:
 
 	std::array<Sprite, 10> lineSprites;
 
-	std::array<uint8_t, 160> bgPixelPriority;
+	//Everything drawing a line needs from outside the ppu apart from VRAM, taken when the line reaches hblank.
+	//Drawing only ever works from one of these, so a line can be drawn straight away or logged and drawn later
+	struct LineState {
+		uint8_t line{ 0 };
+		uint8_t lcdc{ 0 };
+		uint8_t scy{ 0 };
+		uint8_t scx{ 0 };
+		uint8_t bgp{ 0 };
+		uint8_t obp0{ 0 };
+		uint8_t obp1{ 0 };
+		uint8_t wy{ 0 };
+		uint8_t wx{ 0 };
+		bool windowLYTrigger{ false };
+		bool cgbMode{ false };
+		bool dmgPalettes{ false }; //dmg games on a cgb go through BGP/OBP0/OBP1 before the cgb palettes
+		uint8_t vramBank{ 0 };
+		uint8_t spriteCount{ 0 };
+		std::array<Sprite, 10> sprites;
+		uint32_t colors[64]; //the cgb palettes, cgb only
+		uint64_t journalPosition{ 0 }; //how much of the VRAM journal had been written by then, unused when drawing at hblank
+	};
+
+	void CaptureLine(LineState& state);
+
+	void RenderLine();
+
+	void DrawLine(const LineState& state);
+
+	void DrawLoggedLines();
+
+	void ReplayJournal(size_t end);
+
+	void ApplyJournalEntry(uint32_t entry);
+
+	void FinishLines();
+
+	void SendJournal();
+
+	static int RenderThread(void* ppu);
+
+	void RenderWorker();
+
+	void RenderLineDMG(const LineState& state);
+
+	void RenderLineCGB(const LineState& state);
+
+	void RenderTilesDMG(const LineState& state, uint16_t mapRowAddr, uint16_t dataBaseAddr, uint8_t tileY, uint8_t mapX, int startX, const uint8_t bgp[4]);
+
+	void RenderTilesCGB(uint16_t mapRowAddr, uint16_t dataBaseAddr, uint8_t tileY, uint8_t mapX, int startX);
+
+	void RenderSprites(const LineState& state);
+
+	void RenderFrame();
+
+	void UpdatePairColors();
+
+	bool FindChangedLines(int& firstLine, int& lastLine);
+
+	static uint64_t HashLine(const void* data, size_t length, uint64_t seed);
+
+	RENDER_MODE renderMode{ (RENDER_MODE)KGB_PPU_RENDERER };
+	LineState lineState;
+
+	//What lines are drawn from. The mmu's VRAM and tile cache when drawing at hblank, the ppu's own copy otherwise,
+	//which only catches up with the journal as far as the line being drawn
+	const std::array<std::array<uint8_t, 0x2000>, 2>* drawVRAM{ nullptr };
+	TileCache* drawTiles{ nullptr };
+
+	//vblank mode: the lines of the frame so far, and every VRAM write since the last frame was drawn
+	std::vector<LineState> lineLog;
+	std::vector<uint32_t> vramJournal;
+	size_t journalReplayed{ 0 };
+	std::array<std::array<uint8_t, 0x2000>, 2> logVRAM;
+	TileCache logTiles{ logVRAM };
+
+	//worker mode: each line goes to the render thread as it's captured, along with the VRAM writes since the one before.
+	//Everything after that, logVRAM and logTiles included, belongs to the render thread. journalSent and journalApplied
+	//count every entry ever sent and applied, which is what journalPosition is measured in for this mode
+	SDL_Thread* renderThread{ nullptr };
+	std::atomic<bool> stopWorker{ false };
+	SpscQueue<LineState, 256> lineQueue;
+	SpscQueue<uint32_t, 0x10000> journalQueue;
+	uint64_t journalSent{ 0 };
+	uint64_t journalApplied{ 0 };
+
+	//the layers of the line being drawn, merged by the compositor. dmg draws its background straight into WorkingFrameBuffer
+	uint8_t bgLine[160] = { 0 };
+	uint8_t objLine[160] = { 0 };
+	uint32_t lineColors[64] = { 0 }; //the cgb palettes with BGP applied, for dmg games
+	Compositor compositor;
 
 	uint8_t lineSpriteCount{ 0 };
 
 	bool isLCDOn{ true };
 
-	bool blendFrames{ false };
+	bool blendFrames{ true };
 
 	SDL_Texture* ppuTexture{ nullptr };
+	bool streamingTexture{ false }; //frames are written straight into the texture's memory between Lock/UnlockTexture
 	SDL_Texture* ppuBlendTexture{ nullptr };
 	SDL_Renderer* ppuRenderer{ nullptr };
+	FrameExchange* frameExchange{ nullptr };
 
 	const uint32_t palette_gbp_gray[4] = { 0xE0DBCDFF, 0xA89F94FF, 0x706B66FF, 0x2B2B26FF };
 	const uint32_t palette_gbp_green[4] = { 0xDBF4B4FF, 0xABC396FF, 0x7B9278FF, 0x4C625AFF };
@@ -104,5 +209,12 @@ private:
 	const uint32_t palette_mist[4] = { 0xC4F0C2FF, 0x5AB9A8FF, 0x1E606EFF, 0x2D1B00FF };
 
 	uint32_t palette[4] = { 0 };
+	//the colour a dmg pixel comes out as for each pair of shades, indexed by (last frame's << 2) | this frame's
+	uint32_t pairColors[16] = { 0 };
+
+	//a hash of each line of the last frame shown, see FindChangedLines
+	uint64_t lineHashes[144] = { 0 };
+	bool refreshFrame{ true };
+	bool frameUnchanged{ false };
 };
 
@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <array>
+
+//Keeps track of when the ppu, mmu and timers next have something to do, so the cpu only has to bring them up to date
+//at those points instead of after every instruction.
+//Time is counted in cpu cycles. The cpu adds the cycles of each instruction it runs, and once the earliest event is due
+//it hands all the pending cycles to the subsystems in one go and asks each of them when it next needs updating.
+//Between events the subsystems only count cycles, so the only thing that can see they're behind is the game reading
+//one of their registers. The mmu calls Sync before those accesses to catch them up mid-instruction.
+class Scheduler
+{
+public:
+	enum EVENT { PPU = 0, MMU, TIMER, REGISTER_WRITE, EVENT_COUNT };
+
+	//called to bring every subsystem up to date with the pending cycles
+	typedef void (*SyncCallback)(void* user);
+
+	Scheduler(SyncCallback __callback, void* __user);
+
+	void Advance(uint64_t cycles) { pending += cycles; }
+	bool Due() { return now + pending >= nextEvent; }
+	uint64_t CyclesUntilDue() { return Due() ? 0 : nextEvent - (now + pending); }
+
+	//hands over the pending cycles, the subsystems are now up to date with them
+	uint64_t TakePending();
+
+	//when an event next happens, in cycles from now. Anything further away than MaxEventDistance is clamped
+	void Schedule(EVENT event, uint64_t cycles);
+
+	//catch the subsystems up right away, for when the cpu is about to access one of their registers
+	void Sync();
+
+	//a register write can change when things happen (LCDC, STAT, LYC, TAC, DMA...), so update everything at the end
+	//of the instruction, the same point it would have been seen without the scheduler
+	void RegisterWritten();
+
+private:
+	//the subsystems take their cycles as uint16_t, so never let more than this pile up
+	const uint64_t MaxEventDistance = 0x4000;
+
+	uint64_t now = 0;     //cycles the subsystems have been brought up to
+	uint64_t pending = 0; //cycles the cpu has run since then
+	uint64_t nextEvent = 0;
+	std::array<uint64_t, EVENT_COUNT> events = { 0 };
+
+	SyncCallback callback;
+	void* user;
+
+	void UpdateNextEvent();
+};
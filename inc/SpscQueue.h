@@ -0,0 +1,65 @@
+#pragma once
+#include <stddef.h>
+#include <atomic>
+
+//Lock free ring buffer between exactly one producer thread and one consumer thread. The producer fills slots in place
+//with BeginPush/EndPush and the consumer reads them in place with Front/Pop, so nothing is copied twice and neither
+//side ever takes a lock. When the queue is full or empty the calls just say so, waiting is up to the caller.
+//Size has to be a power of two
+template <typename T, size_t Size>
+class SpscQueue
+{
+public:
+	//producer: the next free slot, or nullptr if the queue is full. The consumer can't see it until EndPush
+	T* BeginPush()
+	{
+		size_t write = writeIndex.load(std::memory_order_relaxed);
+		if (write - readIndex.load(std::memory_order_acquire) == Size)
+			return nullptr;
+		return &items[write & (Size - 1)];
+	}
+	void EndPush()
+	{
+		writeIndex.store(writeIndex.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	bool Push(const T& item)
+	{
+		T* slot = BeginPush();
+		if (!slot)
+			return false;
+		*slot = item;
+		EndPush();
+		return true;
+	}
+
+	//consumer: the oldest item, or nullptr if the queue is empty. It stays valid until Pop
+	T* Front()
+	{
+		size_t read = readIndex.load(std::memory_order_relaxed);
+		if (read == writeIndex.load(std::memory_order_acquire))
+			return nullptr;
+		return &items[read & (Size - 1)];
+	}
+	void Pop()
+	{
+		readIndex.store(readIndex.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	//either side. Only a snapshot, the other thread can change it straight after
+	size_t Count()
+	{
+		return writeIndex.load(std::memory_order_acquire) - readIndex.load(std::memory_order_acquire);
+	}
+	bool Empty()
+	{
+		return Count() == 0;
+	}
+
+private:
+	static_assert((Size & (Size - 1)) == 0, "SpscQueue size has to be a power of two");
+
+	//on separate cache lines so the two threads don't keep taking the line off each other
+	alignas(64) std::atomic<size_t> writeIndex{ 0 };
+	alignas(64) std::atomic<size_t> readIndex{ 0 };
+	alignas(64) T items[Size];
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include <array>
+
+//The 384 tiles in each VRAM bank, decoded from 2bpp into one colour index (0-3) per byte, along with a mirrored copy
+//of each for x flipped tiles. The ppu copies rows out of here instead of picking pixels out of the tile bytes.
+//The mmu marks tiles dirty whenever their bytes in VRAM are written, and they're decoded again the next time they're drawn.
+//Tiles are numbered the way the 0x8000 addressing mode does it, so the 0x9000 mode's tiles are 256 + (int8_t)index
+class TileCache
+{
+public:
+	TileCache(const std::array<std::array<uint8_t, 0x2000>, 2>& __vram);
+
+	//addr is the offset into the bank, 0x0000-0x1FFF. Writes to the tile maps are ignored
+	void Invalidate(uint8_t bank, uint16_t addr)
+	{
+		if (addr < 0x1800)
+			dirty[bank][addr >> 4] = true;
+	}
+	void InvalidateRange(uint8_t bank, uint16_t addr, uint16_t length);
+	void InvalidateAll();
+
+	//the 8 pixels of one row of a tile, left to right, or right to left for xflip
+	const uint8_t* GetRow(uint8_t bank, uint16_t tile, uint8_t row, bool xflip)
+	{
+		if (dirty[bank][tile])
+			Decode(bank, tile);
+		return pixels[xflip][bank][tile][row];
+	}
+
+	static const uint16_t TILE_COUNT = 384;
+
+private:
+	const std::array<std::array<uint8_t, 0x2000>, 2>& vram;
+
+	uint8_t pixels[2][2][TILE_COUNT][8][8]; //[xflip][bank][tile][row][x]
+	bool dirty[2][TILE_COUNT];
+
+	void Decode(uint8_t bank, uint16_t tile);
+};
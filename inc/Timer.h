@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+
+//DIV and TIMA. Rather than counting them up as time passes, they're worked out from the number of cycles
+//run since they were last written, whenever the game reads them.
+//Only a TIMA overflow needs handling as it happens, CyclesUntilOverflow says when that is so it can be scheduled.
+class Timer
+{
+public:
+	Timer(uint16_t __divCounter);
+
+	//let cycles pass. Returns true if TIMA overflowed and the timer interrupt should be requested
+	bool Advance(uint64_t cycles);
+	uint64_t CyclesUntilOverflow();
+
+	uint8_t ReadDIV();
+	uint8_t ReadTIMA();
+	uint8_t ReadTMA();
+	uint8_t ReadTAC();
+
+	void WriteDIV(); //any write resets the divider
+	void WriteTIMA(uint8_t val);
+	void WriteTMA(uint8_t val);
+	void WriteTAC(uint8_t val);
+
+	//io handlers for FF04-FF07, registered with the mmu
+	static uint8_t ReadRegister(void* timer, uint16_t addr);
+	static void WriteRegister(void* timer, uint16_t addr, uint8_t val);
+
+private:
+	uint64_t clock = 0; //cycles run in total
+
+	//the 16 bit divider counter, DIV is its top 8 bits. divCounter is its value at divTime
+	uint16_t divCounter;
+	uint64_t divTime = 0;
+
+	//TIMA and the cycles counted towards its next increment, as of timaTime.
+	//Cycles only count while TAC has the timer enabled
+	uint8_t tima = 0;
+	uint64_t timerCycles = 0;
+	uint64_t timaTime = 0;
+	uint64_t overflowTime = UINT64_MAX;
+
+	uint8_t tma = 0;
+	uint8_t tac = 0;
+
+	const uint16_t Thresholds[4] = { 1024, 16, 64, 256 }; //cycles per increment, set by the bottom 2 bits of TAC
+
+	bool UpdateTima();
+	void UpdateOverflowTime();
+};
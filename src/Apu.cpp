@@ -19,6 +19,121 @@ void Apu::ToggleMute()
 	MuteAll = !MuteAll;
 }
 
+uint8_t Apu::ReadRegister(void* apu, uint16_t addr)
+{
+	Apu* a = (Apu*)apu;
+	if (addr == 0xFF26)
+		return a->GetAudioEnable();
+	return a->registers[addr - 0xFF10]; //the mmu sets the unreadable bits
+}
+
+void Apu::WriteRegister(void* apu, uint16_t addr, uint8_t val)
+{
+	Apu* a = (Apu*)apu;
+	uint8_t& reg = a->registers[addr - 0xFF10];
+
+	if (addr >= 0xFF30) //wave ram
+	{
+		a->SetWaveRam(addr & 0x000F, val);
+		reg = val;
+		return;
+	}
+
+	if (addr == 0xFF26)
+	{
+		//Bit 7 - All sound on / off(0: stop all sound circuits) (Read / Write)
+		//Bit 3 - Sound 4 ON flag(Read Only)
+		//Bit 2 - Sound 3 ON flag(Read Only)
+		//Bit 1 - Sound 2 ON flag(Read Only)
+		//Bit 0 - Sound 1 ON flag(Read Only)
+		if (val & 0x80)
+		{
+			a->SetAudioEnable(true);
+		}
+		else
+		{
+			a->SetAudioEnable(false);
+			for (int i = 0xFF10; i < 0xFF26; i++)
+				WriteRegister(apu, i, 0x00);
+			for (int i = 0xFF27; i < 0xFF30; i++)
+				WriteRegister(apu, i, 0x00);
+		}
+		return;
+	}
+
+	if (((a->GetAudioEnable() & 0x80) != 0x80) && val != 0x00)
+		return;
+
+	switch (addr)
+	{
+	case(0xFF10):
+		a->ChannelOneSetSweep(val);
+		break;
+	case(0xFF11):
+		a->ChannelOneSetLength(val);
+		break;
+	case(0xFF12):
+		a->ChannelOneSetVolume(val);
+		break;
+	case(0xFF13):
+		//Frequency's lower 8 bits of 11 bit data (x). Next 3 bits are in NR24 ($FF19).
+		a->ChannelOneSetFreq(val);
+		break;
+	case(0xFF14):
+		a->ChannelOneTrigger(val);
+		break;
+	case(0xFF16):
+		a->ChannelTwoSetLength(val);
+		break;
+	case(0xFF17):
+		a->ChannelTwoSetVolume(val);
+		break;
+	case(0xFF18):
+		//Frequency's lower 8 bits of 11 bit data (x). Next 3 bits are in NR24 ($FF19).
+		a->ChannelTwoSetFreq(val);
+		break;
+	case(0xFF19):
+		a->ChannelTwoTrigger(val);
+		break;
+	case(0xFF1A):
+		a->ChannelThreeSetEnable(val);
+		break;
+	case(0xFF1B):
+		a->ChannelThreeSetLength(val);
+		break;
+	case(0xFF1C):
+		a->ChannelThreeSetVolume(val);
+		break;
+	case(0xFF1D):
+		a->ChannelThreeSetFreq(val);
+		break;
+	case(0xFF1E):
+		a->ChannelThreeTrigger(val);
+		break;
+	case(0xFF20):
+		a->ChannelFourSetLength(val);
+		break;
+	case(0xFF21):
+		a->ChannelFourSetVolume(val);
+		break;
+	case(0xFF22):
+		a->ChannelFourSetPoly(val);
+		break;
+	case(0xFF23):
+		a->ChannelFourTrigger(val);
+		break;
+	case(0xFF24):
+		a->SetMasterVolume(val);
+		break;
+	case(0xFF25):
+		a->SetPan(val);
+		break;
+	default: //FF15, FF1F and FF27-FF2F don't do anything
+		break;
+	}
+	reg = val;
+}
+
 void Apu::Update(uint64_t tcycles, bool doubleSpeedMode)
 {
 	FrameSeqTick(tcycles);
@@ -0,0 +1,193 @@
+#include "BlockCache.h"
+#include <algorithm>
+
+BlockCache::BlockCache(Mmu* __mmu) : mmu(__mmu)
+{
+	lastBlockAt.fill(nullptr);
+}
+
+const MicroOp* BlockCache::Fetch(uint16_t pc)
+{
+	//the boot rom is only run once, and during OAM DMA the cpu sees the bus conflict instead of the real code
+	if (mmu->isBootRomEnabled() || mmu->isDMAInProgress())
+	{
+		current = nullptr;
+		return nullptr;
+	}
+
+	if (!mmu->writtenCodePages.empty())
+	{
+		for (uint16_t codePage : mmu->writtenCodePages)
+			InvalidateCodePage(codePage);
+		mmu->writtenCodePages.clear();
+		current = nullptr;
+	}
+	if (mmu->mapGeneration != mapGeneration)
+	{
+		mapGeneration = mmu->mapGeneration;
+		current = nullptr;
+	}
+
+	//carry on through the current block if execution fell through to its next op
+	if (current && nextIndex < current->ops.size() && current->ops[nextIndex].pc == pc)
+		return &current->ops[nextIndex++];
+
+	current = Lookup(pc);
+	if (!current)
+		return nullptr;
+	nextIndex = 1;
+	return &current->ops[0];
+}
+
+void BlockCache::Flush()
+{
+	blocks.clear();
+	for (std::vector<CodeBlock*>& pageBlocks : ramBlocks)
+		pageBlocks.clear();
+	lastBlockAt.fill(nullptr);
+	current = nullptr;
+}
+
+CodeBlock* BlockCache::EnteredBlock()
+{
+	if (current && nextIndex == 1)
+		return current;
+	return nullptr;
+}
+
+void BlockCache::Leave()
+{
+	current = nullptr;
+}
+
+CodeBlock* BlockCache::Lookup(uint16_t pc)
+{
+	uint32_t key;
+	if (!mmu->GetCodeKey(pc, key))
+		return nullptr;
+
+	CodeBlock* block = lastBlockAt[pc];
+	if (block && block->key == key && block->valid)
+		return block;
+
+	std::unique_ptr<CodeBlock>& entry = blocks[key];
+	if (!entry)
+	{
+		entry.reset(new CodeBlock());
+		entry->key = key;
+	}
+	block = entry.get();
+	if (!block->valid)
+	{
+		Decode(block, pc);
+		if (!block->valid)
+			return nullptr;
+	}
+
+	lastBlockAt[pc] = block;
+	return block;
+}
+
+//Decode from pc until a block ending op, or until the code runs off the end of its 4KB page.
+//Blocks are only checked against the mapping of their first byte, so they can't reach into memory that banks independently
+void BlockCache::Decode(CodeBlock* block, uint16_t pc)
+{
+	block->ops.clear();
+	uint16_t startPage = pc >> 12;
+	uint32_t pcKey = block->key;
+	uint32_t key;
+
+	while (block->ops.size() < MaxBlockOps)
+	{
+		MicroOp op;
+		op.pc = pc;
+		op.opcode = mmu->ReadByteDirect(pc);
+		op.length = OpLength[op.opcode];
+
+		//every byte of the instruction has to sit right after the last one in the same physical memory
+		bool contiguous = true;
+		for (uint8_t i = 0; i < op.length; i++)
+		{
+			if ((uint32_t)pc + i > 0xFFFF || ((pc + i) >> 12) != startPage || !mmu->GetCodeKey(pc + i, key) || key != pcKey + i)
+			{
+				contiguous = false;
+				break;
+			}
+		}
+		if (!contiguous)
+			break;
+
+		for (uint8_t i = 1; i < op.length; i++)
+			op.imm[i - 1] = mmu->ReadByteDirect(pc + i);
+
+		block->ops.push_back(op);
+		if (EndsBlock[op.opcode])
+			break;
+
+		pc += op.length;
+		pcKey += op.length;
+	}
+
+	block->valid = !block->ops.empty();
+	block->idleLoop = block->valid && IsIdleLoop(block);
+
+	//ram blocks are filed under every page they touch (at most two, blocks are short), and the pages flagged so that
+	//writes to them come back here through Mmu::writtenCodePages
+	if (block->valid && block->key >= Mmu::CODEKEY_WRAM)
+	{
+		const MicroOp& last = block->ops.back();
+		uint32_t lastKey = block->key + (last.pc - block->ops[0].pc) + last.length - 1;
+		for (uint32_t page = (block->key - Mmu::CODEKEY_WRAM) >> 8; page <= (lastKey - Mmu::CODEKEY_WRAM) >> 8; page++)
+		{
+			std::vector<CodeBlock*>& pageBlocks = ramBlocks[page];
+			if (std::find(pageBlocks.begin(), pageBlocks.end(), block) == pageBlocks.end())
+				pageBlocks.push_back(block);
+			mmu->MarkCodePage(Mmu::CODEKEY_WRAM + (page << 8));
+		}
+	}
+}
+
+//Throw away the blocks on one page of ram that has been written to. A block on two pages may still be filed under the
+//other one, invalidating it again from there later on only costs a decode
+void BlockCache::InvalidateCodePage(uint16_t codePage)
+{
+	for (CodeBlock* block : ramBlocks[codePage])
+		block->valid = false;
+	ramBlocks[codePage].clear();
+}
+
+//Loops that do nothing but read LY, STAT or IF and test the value, waiting for it to change:
+//	LDH A,(n) or LD A,(nn)
+//	CP/AND n, CP/AND r or BIT b,A
+//	JR/JP cc back to the load
+bool BlockCache::IsIdleLoop(const CodeBlock* block)
+{
+	if (block->ops.size() != 3)
+		return false;
+	const MicroOp& load = block->ops[0];
+	const MicroOp& test = block->ops[1];
+	const MicroOp& jump = block->ops[2];
+
+	uint16_t addr;
+	if (load.opcode == 0xF0)
+		addr = 0xFF00 | load.imm[0];
+	else if (load.opcode == 0xFA)
+		addr = load.imm[0] | (load.imm[1] << 8);
+	else
+		return false;
+	if (addr != 0xFF44 && addr != 0xFF41 && addr != 0xFF0F)
+		return false;
+
+	bool testOk = test.opcode == 0xFE || test.opcode == 0xE6
+		|| ((test.opcode & 0xF8) == 0xB8 && test.opcode != 0xBE)
+		|| ((test.opcode & 0xF8) == 0xA0 && test.opcode != 0xA6)
+		|| (test.opcode == 0xCB && (test.imm[0] & 0xC7) == 0x47);
+	if (!testOk)
+		return false;
+
+	if ((jump.opcode & 0xE7) == 0x20)
+		return (uint16_t)(jump.pc + 2 + (int8_t)jump.imm[0]) == load.pc;
+	if ((jump.opcode & 0xE7) == 0xC2)
+		return (uint16_t)(jump.imm[0] | (jump.imm[1] << 8)) == load.pc;
+	return false;
+}
@@ -0,0 +1,184 @@
+#include "Compositor.h"
+#include <iostream>
+#include <cstring>
+#include <SDL.h>
+
+#if KGB_SIMD_X86
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define KGB_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define KGB_TARGET_AVX2
+#endif
+#endif
+
+Compositor::Compositor()
+{
+#if KGB_SIMD_X86
+	if (SDL_HasAVX2())
+		path = AVX2;
+	else if (SDL_HasSSE2())
+		path = SSE2;
+#endif
+}
+
+void Compositor::Compose(const uint8_t* bg, const uint8_t* obj, bool masterPriority, uint8_t mask, uint8_t* out)
+{
+#if KGB_SIMD_SELF_CHECK
+	uint8_t expected[LINE_WIDTH];
+	ComposeScalar(bg, obj, masterPriority, mask, expected);
+#endif
+
+	switch (path)
+	{
+#if KGB_SIMD_X86
+	case(AVX2): ComposeAVX2(bg, obj, masterPriority, mask, out); break;
+	case(SSE2): ComposeSSE2(bg, obj, masterPriority, mask, out); break;
+#endif
+	default: ComposeScalar(bg, obj, masterPriority, mask, out); break;
+	}
+
+#if KGB_SIMD_SELF_CHECK
+	if (memcmp(expected, out, sizeof(expected)) != 0)
+		std::cout << "WARNING: SIMD compositor (path " << path << ") doesn't match the scalar version" << std::endl;
+#endif
+}
+
+void Compositor::Colorize(const uint8_t* codes, const uint32_t* colors, uint32_t* out)
+{
+#if KGB_SIMD_X86
+	if (path == AVX2)
+	{
+#if KGB_SIMD_SELF_CHECK
+		uint32_t expected[LINE_WIDTH];
+		ColorizeScalar(codes, colors, expected);
+#endif
+		ColorizeAVX2(codes, colors, out);
+#if KGB_SIMD_SELF_CHECK
+		if (memcmp(expected, out, sizeof(expected)) != 0)
+			std::cout << "WARNING: SIMD colour lookup doesn't match the scalar version" << std::endl;
+#endif
+		return;
+	}
+#endif
+	ColorizeScalar(codes, colors, out); //SSE2 has no gather, a plain loop does as well
+}
+
+void Compositor::ColorizePairs(const uint8_t* previous, const uint8_t* current, const uint32_t* pairColors, uint32_t* out)
+{
+#if KGB_SIMD_X86
+	if (path != SCALAR)
+	{
+#if KGB_SIMD_SELF_CHECK
+		uint32_t expected[LINE_WIDTH];
+		ColorizePairsScalar(previous, current, pairColors, expected);
+#endif
+		uint8_t codes[LINE_WIDTH];
+		PairCodesSSE2(previous, current, codes);
+		Colorize(codes, pairColors, out);
+#if KGB_SIMD_SELF_CHECK
+		if (memcmp(expected, out, sizeof(expected)) != 0)
+			std::cout << "WARNING: SIMD frame blend doesn't match the scalar version" << std::endl;
+#endif
+		return;
+	}
+#endif
+	ColorizePairsScalar(previous, current, pairColors, out);
+}
+
+void Compositor::ComposeScalar(const uint8_t* bg, const uint8_t* obj, bool masterPriority, uint8_t mask, uint8_t* out)
+{
+	for (int x = 0; x < LINE_WIDTH; x++)
+	{
+		uint8_t b = bg[x];
+		uint8_t o = obj[x];
+		bool hidden = !(o & OBJ_OPAQUE) || (masterPriority && (b & 0x03) && ((b & BG_PRIORITY) || (o & OBJ_BEHIND_BG)));
+		out[x] = (hidden ? b : o) & mask;
+	}
+}
+
+void Compositor::ColorizeScalar(const uint8_t* codes, const uint32_t* colors, uint32_t* out)
+{
+	for (int x = 0; x < LINE_WIDTH; x++)
+		out[x] = colors[codes[x]];
+}
+
+void Compositor::ColorizePairsScalar(const uint8_t* previous, const uint8_t* current, const uint32_t* pairColors, uint32_t* out)
+{
+	for (int x = 0; x < LINE_WIDTH; x++)
+		out[x] = pairColors[(previous[x] << 2) | current[x]];
+}
+
+#if KGB_SIMD_X86
+//BG_PRIORITY and OBJ_BEHIND_BG are the same bit, so one test of (bg | obj) covers both
+void Compositor::ComposeSSE2(const uint8_t* bg, const uint8_t* obj, bool masterPriority, uint8_t mask, uint8_t* out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i colorBits = _mm_set1_epi8(0x03);
+	const __m128i priorityBit = _mm_set1_epi8((char)BG_PRIORITY);
+	const __m128i opaqueBit = _mm_set1_epi8(OBJ_OPAQUE);
+	const __m128i master = masterPriority ? _mm_set1_epi8(-1) : zero;
+	const __m128i outMask = _mm_set1_epi8((char)mask);
+
+	for (int x = 0; x < LINE_WIDTH; x += 16)
+	{
+		__m128i b = _mm_loadu_si128((const __m128i*)&bg[x]);
+		__m128i o = _mm_loadu_si128((const __m128i*)&obj[x]);
+
+		__m128i bgClear = _mm_cmpeq_epi8(_mm_and_si128(b, colorBits), zero);
+		__m128i behind = _mm_cmpeq_epi8(_mm_and_si128(_mm_or_si128(b, o), priorityBit), priorityBit);
+		__m128i covered = _mm_and_si128(_mm_andnot_si128(bgClear, behind), master);
+		__m128i opaque = _mm_cmpeq_epi8(_mm_and_si128(o, opaqueBit), opaqueBit);
+		__m128i showObj = _mm_andnot_si128(covered, opaque);
+
+		__m128i result = _mm_or_si128(_mm_and_si128(showObj, o), _mm_andnot_si128(showObj, b));
+		_mm_storeu_si128((__m128i*)&out[x], _mm_and_si128(result, outMask));
+	}
+}
+
+KGB_TARGET_AVX2 void Compositor::ComposeAVX2(const uint8_t* bg, const uint8_t* obj, bool masterPriority, uint8_t mask, uint8_t* out)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i colorBits = _mm256_set1_epi8(0x03);
+	const __m256i priorityBit = _mm256_set1_epi8((char)BG_PRIORITY);
+	const __m256i opaqueBit = _mm256_set1_epi8(OBJ_OPAQUE);
+	const __m256i master = masterPriority ? _mm256_set1_epi8(-1) : zero;
+	const __m256i outMask = _mm256_set1_epi8((char)mask);
+
+	for (int x = 0; x < LINE_WIDTH; x += 32)
+	{
+		__m256i b = _mm256_loadu_si256((const __m256i*)&bg[x]);
+		__m256i o = _mm256_loadu_si256((const __m256i*)&obj[x]);
+
+		__m256i bgClear = _mm256_cmpeq_epi8(_mm256_and_si256(b, colorBits), zero);
+		__m256i behind = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_or_si256(b, o), priorityBit), priorityBit);
+		__m256i covered = _mm256_and_si256(_mm256_andnot_si256(bgClear, behind), master);
+		__m256i opaque = _mm256_cmpeq_epi8(_mm256_and_si256(o, opaqueBit), opaqueBit);
+		__m256i showObj = _mm256_andnot_si256(covered, opaque);
+
+		__m256i result = _mm256_blendv_epi8(b, o, showObj);
+		_mm256_storeu_si256((__m256i*)&out[x], _mm256_and_si256(result, outMask));
+	}
+}
+
+//the shades are only 2 bits, so shifting 16 bit lanes can't carry anything into the neighbouring byte
+void Compositor::PairCodesSSE2(const uint8_t* previous, const uint8_t* current, uint8_t* out)
+{
+	for (int x = 0; x < LINE_WIDTH; x += 16)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i*)&previous[x]);
+		__m128i c = _mm_loadu_si128((const __m128i*)&current[x]);
+		_mm_storeu_si128((__m128i*)&out[x], _mm_or_si128(_mm_slli_epi16(p, 2), c));
+	}
+}
+
+KGB_TARGET_AVX2 void Compositor::ColorizeAVX2(const uint8_t* codes, const uint32_t* colors, uint32_t* out)
+{
+	for (int x = 0; x < LINE_WIDTH; x += 8)
+	{
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&codes[x]));
+		__m256i color = _mm256_i32gather_epi32((const int*)colors, index, 4);
+		_mm256_storeu_si256((__m256i*)&out[x], color);
+	}
+}
+#endif
@@ -45,8 +45,16 @@ void audio_callback(void* user, Uint8* stream, int len) {
 	}
 }
 
-Cpu::Cpu(Mmu* __mmu, Ppu* __ppu, Apu* __apu) : mmu(__mmu), ppu(__ppu), apu(__apu)
+Cpu::Cpu(Mmu* __mmu, Ppu* __ppu, Apu* __apu) : mmu(__mmu), ppu(__ppu), apu(__apu),
+#if KGB_SCHEDULER
+	scheduler(&Cpu::SchedulerSync, this),
+#endif
+	blockCache(__mmu)
 {
+#if KGB_SCHEDULER
+	mmu->RegisterScheduler(&scheduler);
+#endif
+
 	if (apu) {
 		SDL_zero(audio_spec);
 		audio_spec.freq = 48000;
@@ -152,6 +160,9 @@ void Cpu::Tick()
 		uint8_t speedReg = mmu->ReadByteDirect(0xFF4D);
 		if (speedReg & 1)
 		{
+#if KGB_SCHEDULER
+			CatchUp(); //the cycles so far were run at the old speed
+#endif
 			isDoubleSpeedEnabled = !isDoubleSpeedEnabled;
 			if (isDoubleSpeedEnabled)
 			{
@@ -164,6 +175,9 @@ void Cpu::Tick()
 				mmu->DMASpeed = 0x01;
 			}
 			//CycleCounter = 8200;
+#if KGB_SCHEDULER
+			ScheduleEvents();
+#endif
 		}
 		PC++;
 		Stopped = false;
@@ -172,24 +186,225 @@ void Cpu::Tick()
 
 	if (Halted)
 	{
+#if KGB_SCHEDULER
+		//nothing can wake the cpu before the next scheduled event, so run all the halted ticks up to it at once
+		uint64_t ticks = HaltedTicksToSkip();
+		OpsCounter += ticks;
+		CycleCounter += ticks * 4;
+#else
 		OpsCounter++;
 		CycleCounter += 4;
+#endif
 	}
 	else
 	{
-		uint8_t nextOp = mmu->ReadByte(PC);
-		PC += 1;
-		Execute(nextOp);
+#if KGB_BLOCK_CACHE
+		const MicroOp* uop = blockCache.Fetch(PC);
+#if KGB_IDLE_LOOPS
+		if (uop && SkipIdleLoop())
+			return;
+#endif
+		if (uop)
+		{
+			PC += 1;
+			immediates = uop->imm;
+			Execute(uop->opcode);
+			immediates = nullptr;
+		}
+		else
+#endif
+		{
+			uint8_t nextOp = mmu->ReadByte(PC);
+			PC += 1;
+			Execute(nextOp);
+		}
 	}
 
 	//PrintCPUState();
+	FinishInstruction();
+}
+
+//Advance everything else by the time the last instruction took
+void Cpu::FinishInstruction()
+{
+#if KGB_SCHEDULER
+	//the ppu, mmu and timers are only updated when the scheduler has an event due, in the same order as below.
+	//Interrupts are still checked after every instruction
+	uint64_t opCycles = CycleCounter;
+	scheduler.Advance(opCycles);
+	bool due = scheduler.Due();
+	uint64_t cycles = 0;
+	if (due)
+		cycles = CatchUpPpuMmu();
+
+	HandleInterrupts();
+	TotalCyclesCounter += CycleCounter;
+	FrameCyclesCounter += CycleCounter;
+
+	//waking from halt or entering an interrupt adds time only the timers see, so they can't be left behind the ppu
+	if (due || CycleCounter != opCycles)
+	{
+		if (!due)
+			cycles = CatchUpPpuMmu();
+		AdvanceTimers(cycles + (CycleCounter - opCycles));
+		ScheduleEvents();
+	}
+	CycleCounter = 0;
+#else
 	UpdatePpu();
 	UpdateMmu();
 	//handle interrupts
 	HandleInterrupts();
 	UpdateTimers(CycleCounter);
 	CycleCounter = 0;
+#endif
+}
+
+#if KGB_SCHEDULER
+void Cpu::SchedulerSync(void* cpu)
+{
+	((Cpu*)cpu)->CatchUp();
+}
+
+//Give the ppu and mmu the cycles run since they were last updated. Returns them so the timers can be given the same
+uint64_t Cpu::CatchUpPpuMmu()
+{
+	uint64_t cycles = scheduler.TakePending();
+	if (cycles)
+	{
+		ppu->Tick(cycles);
+		mmu->Tick(cycles);
+	}
+	return cycles;
+}
+
+//Bring everything up to date part way through an instruction
+void Cpu::CatchUp()
+{
+	AdvanceTimers(CatchUpPpuMmu());
+	ScheduleEvents();
+}
+
+void Cpu::ScheduleEvents()
+{
+	scheduler.Schedule(Scheduler::PPU, ppu->CyclesUntilNextEvent());
+	scheduler.Schedule(Scheduler::MMU, mmu->CyclesUntilNextEvent());
+	scheduler.Schedule(Scheduler::TIMER, mmu->timer.CyclesUntilOverflow());
+	scheduler.Schedule(Scheduler::REGISTER_WRITE, UINT64_MAX);
+}
+
+//How many 4 cycle halted ticks can be run in one go. Interrupt requests only come from the ppu, mmu and timers when
+//they're updated for an event, or from main's input handling between frames, so this runs up to the first tick that
+//has an event due or reaches the end of the frame. Main still sees the frame end on the same tick it used to
+uint64_t Cpu::HaltedTicksToSkip()
+{
+	//the timers raise their interrupt after the check in FinishInstruction, so it wakes the cpu on the following tick
+	if (mmu->pendingInterrupts)
+		return 1;
+
+	uint64_t ticks = (scheduler.CyclesUntilDue() + 3) / 4;
+
+	uint64_t frameCycles = (uint64_t)(456 * 154) * mmu->DMASpeed;
+	uint64_t frameTicks = FrameCyclesCounter < frameCycles ? (frameCycles - FrameCyclesCounter + 3) / 4 : 0;
+	if (frameTicks < ticks)
+		ticks = frameTicks;
+
+	return ticks ? ticks : 1;
+}
+
+#endif
+
+#if KGB_IDLE_LOOPS
+//Called when Fetch enters a block. If it's an idle loop (see BlockCache::IsIdleLoop) that has already been round once
+//and will go round again, every pass until the polled register can next change leaves the cpu exactly as it is now.
+//So those passes are just counted, up to the next scheduler event or the end of the frame, and the loop carries on
+//from there as normal. Returns true if any were skipped
+bool Cpu::SkipIdleLoop()
+{
+	CodeBlock* block = blockCache.EnteredBlock();
+	if (!block || !block->idleLoop || EI_DelayedInterruptEnableFlag)
+		return false;
+	//the timers raise their interrupt after the check in FinishInstruction, so it's taken at the end of the next instruction
+	if (InterruptsEnabled && mmu->pendingInterrupts)
+		return false;
+
+	const MicroOp& load = block->ops[0];
+	const MicroOp& test = block->ops[1];
+	const MicroOp& jump = block->ops[2];
+
+	uint16_t addr = (load.opcode == 0xF0) ? (0xFF00 | load.imm[0]) : (load.imm[0] | (load.imm[1] << 8));
+	uint8_t val = mmu->ReadByteDirect(addr);
+
+	//work out what one pass leaves in A and F
+	uint8_t f = GetF();
+	uint8_t a = val;
+	uint8_t operand = 0;
+	switch (test.opcode & 0x07)
+	{
+	case(0): operand = Regs.B; break;
+	case(1): operand = Regs.C; break;
+	case(2): operand = Regs.D; break;
+	case(3): operand = Regs.E; break;
+	case(4): operand = Regs.H; break;
+	case(5): operand = Regs.L; break;
+	case(7): operand = val; break; //A, after the load
+	}
+	if (test.opcode == 0xFE || test.opcode == 0xE6)
+		operand = test.imm[0];
+
+	uint8_t cycles = CyclesPerOp[load.opcode] + CyclesPerOp[jump.opcode] + 4; //+4 for the branch being taken
+	if (test.opcode == 0xCB) //BIT b,A
+	{
+		uint8_t bit = (test.imm[0] >> 3) & 0x07;
+		f = ((((val >> bit) & 1) == 0) << 7) | 0x20 | (f & 0x10);
+		cycles += CyclesPerOpCB[test.imm[0]];
+	}
+	else if ((test.opcode & 0xF8) == 0xA0 || test.opcode == 0xE6) //AND
+	{
+		a = val & operand;
+		f = ((a == 0) << 7) | 0x20;
+		cycles += CyclesPerOp[test.opcode];
+	}
+	else //CP
+	{
+		f = ((val == operand) << 7) | 0x40 | (((val & 0x0F) < (operand & 0x0F)) << 5) | ((val < operand) << 4);
+		cycles += CyclesPerOp[test.opcode];
+	}
+
+	//the cpu has to be in the state the loop leaves it in, otherwise this is the first pass and has to really run
+	if (Regs.A != a || GetF() != f)
+		return false;
+
+	bool zero = f & 0x80;
+	bool carry = f & 0x10;
+	bool taken;
+	switch ((jump.opcode >> 3) & 0x03)
+	{
+	case(0): taken = !zero; break;
+	case(1): taken = zero; break;
+	case(2): taken = !carry; break;
+	default: taken = carry; break;
+	}
+	if (!taken)
+		return false;
+
+	//every instruction boundary inside the skipped passes has to come before the next event and the end of the frame
+	uint64_t passes = scheduler.CyclesUntilDue();
+	passes = passes ? (passes - 1) / cycles : 0;
+	uint64_t frameCycles = (uint64_t)(456 * 154) * mmu->DMASpeed;
+	uint64_t framePasses = FrameCyclesCounter < frameCycles ? (frameCycles - FrameCyclesCounter - 1) / cycles : 0;
+	if (framePasses < passes)
+		passes = framePasses;
+	if (passes == 0)
+		return false;
+
+	OpsCounter += passes * 3;
+	CycleCounter = passes * cycles;
+	FinishInstruction();
+	blockCache.Leave();
+	return true;
 }
+#endif
 
 void Cpu::Push(uint16_t addr)
 {
@@ -282,43 +497,33 @@ void Cpu::SetCarry(int newVal)
 
 void Cpu::CalcCarry(uint8_t OpA, uint8_t OpB, uint8_t inputCarryBit, bool subtraction, CARRYMODE carryMode)
 {
+	uint32_t tempSum = OpA + (subtraction ? ~OpB : OpB) + (subtraction ? (!(inputCarryBit)) : inputCarryBit);
+	uint32_t carryBits = tempSum ^ OpA ^ OpB; //some stack overflow magic for calculating carry bits
+
 	if (carryMode == CARRYMODE::HALFCARRY || carryMode == CARRYMODE::BOTH) //set half carry
 	{
-		uint32_t tempSum = OpA + (subtraction ? ~OpB : OpB) + (subtraction ? (!(inputCarryBit)) : inputCarryBit);
-
-		uint8_t newHC = ((tempSum ^ OpA ^ OpB) >> 4) & 1; //some stack overflow magic for calculating carry bits
-
-		SetHalfCarry(newHC);
+		SetHalfCarry((carryBits >> 4) & 1);
 	}
 
 	if (carryMode == CARRYMODE::CARRY || carryMode == CARRYMODE::BOTH) //set carry
 	{
-		uint32_t tempSum = OpA + (subtraction ? ~OpB : OpB) + (subtraction ? (!(inputCarryBit)) : inputCarryBit);
-
-		uint8_t newC = ((tempSum ^ OpA ^ OpB) >> 8) & 1; //some stack overflow magic for calculating carry bits
-
-		SetCarry(newC);
+		SetCarry((carryBits >> 8) & 1);
 	}
 }
 
 void Cpu::CalcCarry16(uint16_t OpA, uint16_t OpB, uint8_t inputCarryBit, bool subtraction, CARRYMODE carryMode)
 {
+	uint32_t tempSum = OpA + (subtraction ? ~OpB : OpB) + (subtraction ? (!(inputCarryBit)) : inputCarryBit);
+	uint32_t carryBits = tempSum ^ OpA ^ OpB; //some stack overflow magic for calculating carry bits
+
 	if (carryMode == CARRYMODE::HALFCARRY || carryMode == CARRYMODE::BOTH) //set half carry
 	{
-		uint32_t tempSum = OpA + (subtraction ? ~OpB : OpB) + (subtraction ? (!(inputCarryBit)) : inputCarryBit);
-
-		uint8_t newHC = ((tempSum ^ OpA ^ OpB) >> 12) & 1; //some stack overflow magic for calculating carry bits
-
-		SetHalfCarry(newHC);
+		SetHalfCarry((carryBits >> 12) & 1);
 	}
 
 	if (carryMode == CARRYMODE::CARRY || carryMode == CARRYMODE::BOTH) //set carry
 	{
-		uint32_t tempSum = OpA + (subtraction ? ~OpB : OpB) + (subtraction ? (!(inputCarryBit)) : inputCarryBit);
-
-		uint8_t newC = ((tempSum ^ OpA ^ OpB) >> 16) & 1; //some stack overflow magic for calculating carry bits
-
-		SetCarry(newC);
+		SetCarry((carryBits >> 16) & 1);
 	}
 }
 
@@ -342,6 +547,21 @@ void Cpu::SyncFlagsFromReg()
 	flags.negative = ((Regs.F & 0x40) >> 6);
 	flags.halfcarry = ((Regs.F & 0x20) >> 5);
 	flags.carry = ((Regs.F & 0x10) >> 4);
+#if KGB_LAZY_FLAGS
+	lazyFlags.result = flags.zero ? 0 : 1;
+	lazyFlags.negative = flags.negative;
+	lazyFlags.carryBits = (flags.halfcarry << 4) | (flags.carry << 8);
+#endif
+}
+
+//The F register as the game would see it
+uint8_t Cpu::GetF()
+{
+#if KGB_LAZY_FLAGS
+	return ((lazyFlags.result == 0) << 7) | (lazyFlags.negative << 6) | (((lazyFlags.carryBits >> 4) & 1) << 5) | (((lazyFlags.carryBits >> 8) & 1) << 4);
+#else
+	return Regs.F;
+#endif
 }
 
 void Cpu::TestBit(uint8_t Op, uint8_t bitNum)
@@ -371,12 +591,13 @@ void Cpu::HandleInterrupts()
 	//Bit 3: Serial   0x58
 	//Bit 4: Joypad   0x60
 
-	uint8_t REG_IE = mmu->ReadByteDirect(0xFFFF);
-	uint8_t REG_IF = mmu->ReadByteDirect(0xFF0F);
-
-	//at least 1 interrupt is both enabled and requested
-	if (REG_IE & REG_IF & 0x1F)
+	//at least 1 interrupt is both enabled and requested. The mmu keeps this up to date as IE and IF are written,
+	//IME only matters once there is one
+	if (mmu->pendingInterrupts)
 	{
+		uint8_t REG_IE = mmu->ReadByteDirect(0xFFFF);
+		uint8_t REG_IF = mmu->ReadByteDirect(0xFF0F);
+
 		//even if IME is disabled, any interrupt that's enabled and requested will clear Halt status
 		if (Halted)
 		{
@@ -424,60 +645,21 @@ void Cpu::HandleInterrupts()
 
 void Cpu::UpdateTimers(uint16_t cycles)
 {
-	mmu->master_clock += cycles;
-
-	if (!Stopped) //update DIV
-	{
-		//div_cycles += cycles;
-		//uint8_t div = mmu->ReadByte(0xFF04);
-
-		//while (div_cycles >= 256)
-		//{
-		//	div++;
-		//	div_cycles -= 256;
-		//}
-		uint8_t div = mmu->master_clock >> 8;
-		mmu->WriteByteDirect(0xFF04, div);
-
-	}
-
-	
-	uint8_t tima = mmu->ReadByteDirect(0xFF05);
-	uint8_t tma  = mmu->ReadByteDirect(0xFF06);
-	uint8_t tac  = mmu->ReadByteDirect(0xFF07);
-	
-
-	if (tac & 0x04) // tac & 0000 0100, timer enable bit
-	{
-		timer_cycles += cycles;
-		uint16_t cycle_threshold = timer_cycle_thresholds[tac & 0x03]; // frequency set by bottom 2 bits of tac. tac & 0000 0011
-		while (timer_cycles >= cycle_threshold)
-		{
-			if (tima == 0xFF) // increasing the timer would overflow
-			{
-				//set timer counter to the timer modulo value
-				tima = tma;
-				mmu->WriteByte(0xFF05, tima);
-
-				//request timer interrupt by setting bit 2 of 0xFF0F
-				uint8_t reg_if = mmu->ReadByte(0xFF0F);
-				reg_if |= 0x04;
-				mmu->WriteByte(0xFF0F, reg_if);
-			}
-			else
-				tima++;
-
-			timer_cycles -= cycle_threshold;
-
-		}
-
-		mmu->WriteByte(0xFF05, tima);
-
-	}
-
+	AdvanceTimers(cycles);
 	TotalCyclesCounter += cycles;
 	FrameCyclesCounter += cycles;
+}
 
+//DIV and TIMA are worked out by the timer when they're read, it only has to be told how much time has passed
+void Cpu::AdvanceTimers(uint16_t cycles)
+{
+	if (mmu->timer.Advance(cycles))
+	{
+		//request timer interrupt by setting bit 2 of 0xFF0F
+		uint8_t reg_if = mmu->ReadByte(0xFF0F);
+		reg_if |= 0x04;
+		mmu->WriteByte(0xFF0F, reg_if);
+	}
 }
 
 void Cpu::UpdatePpu()
@@ -499,6 +681,9 @@ void Cpu::Execute(uint8_t op)
 	InterruptsEnabled = (InterruptsEnabled || EI_DelayedInterruptEnableFlag);
 	EI_DelayedInterruptEnableFlag = false;
 
+#if KGB_TABLE_DISPATCH
+	(this->*OpTable[op])();
+#else
 	//temporary immediate values
 	uint8_t u8iv;
 	int8_t i8iv;
@@ -1154,6 +1339,7 @@ void Cpu::Execute(uint8_t op)
 		Stopped = true;
 		break;
 	}
+#endif
 
 	return;
 }
@@ -1162,7 +1348,7 @@ void Cpu::PrintCPUState()
 {
 	std::cout
 	<< "A: " << std::hex << std::setfill('0') << std::uppercase << std::setw(2) << (int)Regs.A << ' '
-	<< "F: " << std::hex << std::setfill('0') << std::uppercase << std::setw(2) << (int)Regs.F << ' '
+	<< "F: " << std::hex << std::setfill('0') << std::uppercase << std::setw(2) << (int)GetF() << ' '
 	<< "B: " << std::hex << std::setfill('0') << std::uppercase << std::setw(2) << (int)Regs.B << ' '
 	<< "C: " << std::hex << std::setfill('0') << std::uppercase << std::setw(2) << (int)Regs.C << ' '
 	<< "D: " << std::hex << std::setfill('0') << std::uppercase << std::setw(2) << (int)Regs.D << ' '
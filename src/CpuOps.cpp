@@ -0,0 +1,565 @@
+#include "Cpu.h"
+#include <iostream>
+#include <iomanip>
+
+//Table driven opcode dispatch. Every opcode gets its own handler, built from a handful of templates
+//parameterized on the register/condition fields of the opcode. The tables are filled in at compile time
+//by decoding each opcode number, so the handlers and the switch in Cpu::Execute share the same semantics
+//and Cpu::Execute can pick either one through KGB_TABLE_DISPATCH (see Config.h).
+
+//Operand helpers
+
+template<uint8_t r>
+inline uint8_t Cpu::GetR8()
+{
+	if constexpr (r == 0) return Regs.B;
+	else if constexpr (r == 1) return Regs.C;
+	else if constexpr (r == 2) return Regs.D;
+	else if constexpr (r == 3) return Regs.E;
+	else if constexpr (r == 4) return Regs.H;
+	else if constexpr (r == 5) return Regs.L;
+	else if constexpr (r == 6) return mmu->ReadByte(Regs.HL);
+	else return Regs.A;
+}
+
+//Immediate operands come from the decoded micro-op when the block cache supplied the instruction
+inline uint8_t Cpu::ReadImm8()
+{
+	if (immediates)
+	{
+		PC++;
+		return *immediates++;
+	}
+	return mmu->ReadByte(PC++);
+}
+
+inline uint16_t Cpu::ReadImm16()
+{
+	uint16_t val;
+	if (immediates)
+	{
+		val = (uint16_t)((immediates[1] << 8) | immediates[0]);
+		immediates += 2;
+	}
+	else
+		val = mmu->ReadWord(PC);
+	PC += 2;
+	return val;
+}
+
+template<uint8_t r>
+inline void Cpu::SetR8(uint8_t val)
+{
+	if constexpr (r == 0) Regs.B = val;
+	else if constexpr (r == 1) Regs.C = val;
+	else if constexpr (r == 2) Regs.D = val;
+	else if constexpr (r == 3) Regs.E = val;
+	else if constexpr (r == 4) Regs.H = val;
+	else if constexpr (r == 5) Regs.L = val;
+	else if constexpr (r == 6) mmu->WriteByte(Regs.HL, val);
+	else Regs.A = val;
+}
+
+template<uint8_t p>
+inline uint16_t& Cpu::R16()
+{
+	if constexpr (p == 0) return Regs.BC;
+	else if constexpr (p == 1) return Regs.DE;
+	else if constexpr (p == 2) return Regs.HL;
+	else return SP;
+}
+
+template<uint8_t cc>
+inline bool Cpu::CheckCondition()
+{
+	if constexpr (cc == 0) return !FlagZ();
+	else if constexpr (cc == 1) return FlagZ();
+	else if constexpr (cc == 2) return !FlagC();
+	else if constexpr (cc == 3) return FlagC();
+	else return true;
+}
+
+//writes all four flags at once instead of going through SetZero/SetNeg/SetHalfCarry/SetCarry.
+//the bottom nibble of F is always 0 after any of those calls, so this matches them exactly
+inline void Cpu::SetFlagsZNHC(uint8_t z, uint8_t n, uint8_t h, uint8_t c)
+{
+	flags.zero = z;
+	flags.negative = n;
+	flags.halfcarry = h;
+	flags.carry = c;
+	Regs.F = (z << 7) | (n << 6) | (h << 5) | (c << 4);
+}
+
+//Flag updates used by the handlers. carryBits has the half carry in bit 4 and the carry in bit 8, the way
+//they fall out of (sum ^ a ^ b) for 8 bit math. With KGB_LAZY_FLAGS these only record the result and carry bits,
+//and the flags themselves are worked out by FlagZ/FlagN/FlagH/FlagC or GetF when something reads them
+inline void Cpu::SetFlagsResult(uint8_t result, uint8_t n, uint16_t carryBits)
+{
+#if KGB_LAZY_FLAGS
+	lazyFlags.result = result;
+	lazyFlags.negative = n;
+	lazyFlags.carryBits = carryBits;
+#else
+	SetFlagsZNHC(result == 0, n, (carryBits >> 4) & 1, (carryBits >> 8) & 1);
+#endif
+}
+
+//same as SetFlagsResult but leaves Z alone
+inline void Cpu::SetFlagsKeepZ(uint8_t n, uint16_t carryBits)
+{
+#if KGB_LAZY_FLAGS
+	lazyFlags.negative = n;
+	lazyFlags.carryBits = carryBits;
+#else
+	SetFlagsZNHC(flags.zero, n, (carryBits >> 4) & 1, (carryBits >> 8) & 1);
+#endif
+}
+
+#if KGB_LAZY_FLAGS
+inline uint8_t Cpu::FlagZ() { return lazyFlags.result == 0; }
+inline uint8_t Cpu::FlagN() { return lazyFlags.negative; }
+inline uint8_t Cpu::FlagH() { return (lazyFlags.carryBits >> 4) & 1; }
+inline uint8_t Cpu::FlagC() { return (lazyFlags.carryBits >> 8) & 1; }
+#else
+inline uint8_t Cpu::FlagZ() { return flags.zero; }
+inline uint8_t Cpu::FlagN() { return flags.negative; }
+inline uint8_t Cpu::FlagH() { return flags.halfcarry; }
+inline uint8_t Cpu::FlagC() { return flags.carry; }
+#endif
+
+//same math as SetFlags + CalcCarry with CARRYMODE::BOTH, but the sum is only computed once. Returns the 8 bit result
+inline uint8_t Cpu::AddSub8(uint8_t OpA, uint8_t OpB, uint8_t inputCarryBit, bool subtraction)
+{
+	uint32_t tempSum = OpA + (subtraction ? ~OpB : OpB) + (subtraction ? (!(inputCarryBit)) : inputCarryBit);
+	uint32_t carryBits = tempSum ^ OpA ^ OpB;
+	uint8_t answer = (uint8_t)tempSum;
+	SetFlagsResult(answer, subtraction, (uint16_t)carryBits);
+	return answer;
+}
+
+//Misc
+
+void Cpu::Op_NOP() {}
+void Cpu::Op_STOP() { Stopped = true; }
+void Cpu::Op_HALT() { Halted = true; }
+void Cpu::Op_DI() { InterruptsEnabled = false; }
+void Cpu::Op_EI() { EI_DelayedInterruptEnableFlag = true; }
+
+void Cpu::Op_DAA()
+{
+	uint8_t carry = FlagC();
+	if (FlagN())
+	{
+		if (FlagC())
+		{
+			Regs.A -= 0x60;
+			carry = 1;
+		}
+		if (FlagH())
+		{
+			Regs.A -= 0x06;
+		}
+	}
+	else
+	{
+		if (FlagC() || Regs.A > 0x99)
+		{
+			Regs.A += 0x60;
+			carry = 1;
+		}
+		if (FlagH() || ((Regs.A & 0x0F) > 0x09))
+		{
+			Regs.A += 0x06;
+		}
+	}
+	SetFlagsResult(Regs.A, FlagN(), carry << 8);
+}
+
+void Cpu::Op_CPL() { Regs.A = ~Regs.A; SetFlagsKeepZ(1, 0x10 | (FlagC() << 8)); }
+void Cpu::Op_SCF() { SetFlagsKeepZ(0, 0x100); }
+void Cpu::Op_CCF() { SetFlagsKeepZ(0, (FlagC() ^ 1) << 8); }
+
+// RLCA, RRCA, RLA, RRA
+template<uint8_t y>
+void Cpu::Op_RotA()
+{
+	uint8_t carry;
+	if constexpr (y == 0) { carry = Regs.A >> 7; Regs.A = (Regs.A << 1) | carry; }
+	else if constexpr (y == 1) { carry = Regs.A & 1; Regs.A = (Regs.A >> 1) | (carry << 7); }
+	else if constexpr (y == 2) { carry = Regs.A >> 7; Regs.A = (Regs.A << 1) | FlagC(); }
+	else { carry = Regs.A & 1; Regs.A = (Regs.A >> 1) | (FlagC() << 7); }
+	SetFlagsResult(1, 0, carry << 8); //Z is always cleared
+}
+
+//Load/Store/Move 8-bit
+
+template<uint8_t r>
+void Cpu::Op_LD_r_n() { SetR8<r>(ReadImm8()); }
+
+template<uint8_t dst, uint8_t src>
+void Cpu::Op_LD_r_r() { SetR8<dst>(GetR8<src>()); }
+
+// LD (BC), A / LD (DE), A / LD (HL+), A / LD (HL-), A
+template<uint8_t p>
+void Cpu::Op_LD_ind_A()
+{
+	if constexpr (p == 0) mmu->WriteByte(Regs.BC, Regs.A);
+	else if constexpr (p == 1) mmu->WriteByte(Regs.DE, Regs.A);
+	else if constexpr (p == 2) mmu->WriteByte(Regs.HL++, Regs.A);
+	else mmu->WriteByte(Regs.HL--, Regs.A);
+}
+
+// LD A, (BC) / LD A, (DE) / LD A, (HL+) / LD A, (HL-)
+template<uint8_t p>
+void Cpu::Op_LD_A_ind()
+{
+	if constexpr (p == 0) Regs.A = mmu->ReadByte(Regs.BC);
+	else if constexpr (p == 1) Regs.A = mmu->ReadByte(Regs.DE);
+	else if constexpr (p == 2) Regs.A = mmu->ReadByte(Regs.HL++);
+	else Regs.A = mmu->ReadByte(Regs.HL--);
+}
+
+void Cpu::Op_LDH_n_A() { mmu->WriteByte(0xFF00 + ReadImm8(), Regs.A); }
+void Cpu::Op_LDH_C_A() { mmu->WriteByte(0xFF00 + Regs.C, Regs.A); }
+void Cpu::Op_LD_nn_A() { mmu->WriteByte(ReadImm16(), Regs.A); }
+void Cpu::Op_LDH_A_n() { uint8_t offset = ReadImm8(); Regs.A = mmu->ReadByte(0xFF00 + offset); }
+void Cpu::Op_LDH_A_C() { Regs.A = mmu->ReadByte(0xFF00 + Regs.C); }
+void Cpu::Op_LD_A_nn() { uint16_t addr = ReadImm16(); Regs.A = mmu->ReadByte(addr); }
+
+//Load/Store/Move 16-bit
+
+template<uint8_t p>
+void Cpu::Op_LD_rr_nn() { R16<p>() = ReadImm16(); }
+
+template<uint8_t p>
+void Cpu::Op_PUSH()
+{
+	if constexpr (p == 3)
+	{
+		Regs.F = GetF();
+		Push(Regs.AF);
+	}
+	else Push(R16<p>());
+}
+
+template<uint8_t p>
+void Cpu::Op_POP()
+{
+	if constexpr (p == 3)
+	{
+		Regs.AF = (Pop() & 0xFFF0);
+		SyncFlagsFromReg();
+	}
+	else R16<p>() = Pop();
+}
+
+void Cpu::Op_LD_nn_SP() { mmu->WriteWord(ReadImm16(), SP); }
+
+void Cpu::Op_LD_HL_SPi8()
+{
+	int8_t offset = ReadImm8();
+	uint8_t spLow = SP & 0xFF;
+	uint32_t carryBits = (spLow + (uint8_t)offset) ^ spLow ^ (uint8_t)offset;
+	SetFlagsResult(1, 0, (uint16_t)carryBits); //Z is always cleared
+	Regs.HL = SP + offset;
+}
+
+void Cpu::Op_LD_SP_HL() { SP = Regs.HL; }
+
+//ALU 8-bit
+
+template<uint8_t r>
+void Cpu::Op_INC_r()
+{
+	uint8_t val = GetR8<r>();
+	uint8_t result = val + 1;
+	SetFlagsResult(result, 0, ((result ^ val ^ 1) & 0x10) | (FlagC() << 8));
+	SetR8<r>(result);
+}
+
+template<uint8_t r>
+void Cpu::Op_DEC_r()
+{
+	uint8_t val = GetR8<r>();
+	uint8_t result = val - 1;
+	SetFlagsResult(result, 1, ((result ^ val ^ 1) & 0x10) | (FlagC() << 8));
+	SetR8<r>(result);
+}
+
+//ADD, ADC, SUB, SBC, AND, XOR, OR, CP. r == 8 takes an immediate u8 operand
+template<uint8_t alu, uint8_t r>
+void Cpu::Op_ALU()
+{
+	uint8_t val;
+	if constexpr (r == 8) val = ReadImm8();
+	else val = GetR8<r>();
+
+	if constexpr (alu == 0) Regs.A = AddSub8(Regs.A, val, 0, false);
+	else if constexpr (alu == 1) Regs.A = AddSub8(Regs.A, val, FlagC(), false);
+	else if constexpr (alu == 2) Regs.A = AddSub8(Regs.A, val, 0, true);
+	else if constexpr (alu == 3) Regs.A = AddSub8(Regs.A, val, FlagC(), true);
+	else if constexpr (alu == 4) { Regs.A &= val; SetFlagsResult(Regs.A, 0, 0x10); }
+	else if constexpr (alu == 5) { Regs.A ^= val; SetFlagsResult(Regs.A, 0, 0); }
+	else if constexpr (alu == 6) { Regs.A |= val; SetFlagsResult(Regs.A, 0, 0); }
+	else AddSub8(Regs.A, val, 0, true);
+}
+
+//ALU 16-bit
+
+template<uint8_t p>
+void Cpu::Op_INC_rr() { R16<p>()++; }
+
+template<uint8_t p>
+void Cpu::Op_DEC_rr() { R16<p>()--; }
+
+template<uint8_t p>
+void Cpu::Op_ADD_HL_rr()
+{
+	uint16_t val = R16<p>();
+	uint32_t tempSum = Regs.HL + val;
+	uint32_t carryBits = tempSum ^ Regs.HL ^ val;
+	SetFlagsKeepZ(0, (uint16_t)(carryBits >> 8)); //bits 12 and 16 of the 16 bit carries land in bits 4 and 8
+	Regs.HL = (uint16_t)tempSum;
+}
+
+void Cpu::Op_ADD_SP_i8()
+{
+	int8_t offset = ReadImm8();
+	uint8_t spLow = SP & 0xFF;
+	uint32_t carryBits = (spLow + (uint8_t)offset) ^ spLow ^ (uint8_t)offset;
+	SetFlagsResult(1, 0, (uint16_t)carryBits); //Z is always cleared
+	SP += offset;
+}
+
+//Jumps. Conditional versions add the extra cycles for a taken branch on top of CyclesPerOp
+
+template<uint8_t cc>
+void Cpu::Op_JR()
+{
+	int8_t offset = ReadImm8();
+	if (CheckCondition<cc>())
+	{
+		if constexpr (cc != 4) CycleCounter += 4;
+		PC += offset;
+	}
+}
+
+template<uint8_t cc>
+void Cpu::Op_JP()
+{
+	uint16_t addr = ReadImm16();
+	if (CheckCondition<cc>())
+	{
+		if constexpr (cc != 4) CycleCounter += 4;
+		PC = addr;
+	}
+}
+
+template<uint8_t cc>
+void Cpu::Op_CALL()
+{
+	uint16_t addr = ReadImm16();
+	if (CheckCondition<cc>())
+	{
+		if constexpr (cc != 4) CycleCounter += 12;
+		Push(PC);
+		PC = addr;
+	}
+}
+
+template<uint8_t cc>
+void Cpu::Op_RET()
+{
+	if (CheckCondition<cc>())
+	{
+		if constexpr (cc != 4) CycleCounter += 12;
+		PC = Pop();
+	}
+}
+
+void Cpu::Op_RETI() { PC = Pop(); InterruptsEnabled = true; }
+void Cpu::Op_JP_HL() { PC = Regs.HL; }
+
+template<uint8_t n>
+void Cpu::Op_RST() { Push(PC); PC = n; }
+
+template<uint8_t op>
+void Cpu::Op_Undefined()
+{
+	std::cout << "Undefined instruction: 0x"
+		<< std::hex << std::setfill('0') << std::uppercase << std::setw(2)
+		<< (int)op << std::endl;
+	PrintCPUState();
+
+	Stopped = true;
+}
+
+//The CB alternate-op table
+
+void Cpu::Op_CB()
+{
+	uint8_t subop = ReadImm8();
+	CycleCounter += CyclesPerOpCB[subop];
+	(this->*CBTable[subop])();
+}
+
+// RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL
+template<uint8_t y, uint8_t r>
+void Cpu::Op_CB_Rot()
+{
+	uint8_t val = GetR8<r>();
+	uint8_t result;
+	uint8_t carry;
+	if constexpr (y == 0) { carry = val >> 7; result = (val << 1) | carry; }
+	else if constexpr (y == 1) { carry = val & 1; result = (val >> 1) | (carry << 7); }
+	else if constexpr (y == 2) { carry = val >> 7; result = (val << 1) | FlagC(); }
+	else if constexpr (y == 3) { carry = val & 1; result = (val >> 1) | (FlagC() << 7); }
+	else if constexpr (y == 4) { carry = val >> 7; result = val << 1; }
+	else if constexpr (y == 5) { carry = val & 1; result = (val >> 1) | (val & 0x80); }
+	else if constexpr (y == 6) { carry = 0; result = (val >> 4) | (val << 4); }
+	else { carry = val & 1; result = val >> 1; }
+	SetR8<r>(result);
+	//the zero flag comes from reading the operand back, which matters for (HL) on read-only or masked addresses
+	SetFlagsResult(GetR8<r>(), 0, carry << 8);
+}
+
+template<uint8_t b, uint8_t r>
+void Cpu::Op_CB_BIT() { SetFlagsResult(GetR8<r>() & (1 << b), 0, 0x10 | (FlagC() << 8)); }
+
+template<uint8_t b, uint8_t r>
+void Cpu::Op_CB_RES() { SetR8<r>(GetR8<r>() & ~(1 << b)); }
+
+template<uint8_t b, uint8_t r>
+void Cpu::Op_CB_SET() { SetR8<r>(GetR8<r>() | (1 << b)); }
+
+//Opcode decoding. x = bits 7-6, y = bits 5-3, z = bits 2-0, p = bits 5-4, q = bit 3
+
+template<uint8_t op>
+constexpr Cpu::OpHandler Cpu::DecodeOp()
+{
+	constexpr uint8_t x = op >> 6;
+	constexpr uint8_t y = (op >> 3) & 7;
+	constexpr uint8_t z = op & 7;
+	constexpr uint8_t p = y >> 1;
+	constexpr uint8_t q = y & 1;
+
+	if constexpr (x == 0)
+	{
+		if constexpr (z == 0)
+		{
+			if constexpr (y == 0) return &Cpu::Op_NOP;
+			else if constexpr (y == 1) return &Cpu::Op_LD_nn_SP;
+			else if constexpr (y == 2) return &Cpu::Op_STOP;
+			else if constexpr (y == 3) return &Cpu::Op_JR<4>;
+			else return &Cpu::Op_JR<y - 4>;
+		}
+		else if constexpr (z == 1)
+		{
+			if constexpr (q == 0) return &Cpu::Op_LD_rr_nn<p>;
+			else return &Cpu::Op_ADD_HL_rr<p>;
+		}
+		else if constexpr (z == 2)
+		{
+			if constexpr (q == 0) return &Cpu::Op_LD_ind_A<p>;
+			else return &Cpu::Op_LD_A_ind<p>;
+		}
+		else if constexpr (z == 3)
+		{
+			if constexpr (q == 0) return &Cpu::Op_INC_rr<p>;
+			else return &Cpu::Op_DEC_rr<p>;
+		}
+		else if constexpr (z == 4) return &Cpu::Op_INC_r<y>;
+		else if constexpr (z == 5) return &Cpu::Op_DEC_r<y>;
+		else if constexpr (z == 6) return &Cpu::Op_LD_r_n<y>;
+		else
+		{
+			if constexpr (y < 4) return &Cpu::Op_RotA<y>;
+			else if constexpr (y == 4) return &Cpu::Op_DAA;
+			else if constexpr (y == 5) return &Cpu::Op_CPL;
+			else if constexpr (y == 6) return &Cpu::Op_SCF;
+			else return &Cpu::Op_CCF;
+		}
+	}
+	else if constexpr (x == 1)
+	{
+		if constexpr (op == 0x76) return &Cpu::Op_HALT;
+		else return &Cpu::Op_LD_r_r<y, z>;
+	}
+	else if constexpr (x == 2) return &Cpu::Op_ALU<y, z>;
+	else
+	{
+		if constexpr (z == 0)
+		{
+			if constexpr (y < 4) return &Cpu::Op_RET<y>;
+			else if constexpr (y == 4) return &Cpu::Op_LDH_n_A;
+			else if constexpr (y == 5) return &Cpu::Op_ADD_SP_i8;
+			else if constexpr (y == 6) return &Cpu::Op_LDH_A_n;
+			else return &Cpu::Op_LD_HL_SPi8;
+		}
+		else if constexpr (z == 1)
+		{
+			if constexpr (q == 0) return &Cpu::Op_POP<p>;
+			else if constexpr (p == 0) return &Cpu::Op_RET<4>;
+			else if constexpr (p == 1) return &Cpu::Op_RETI;
+			else if constexpr (p == 2) return &Cpu::Op_JP_HL;
+			else return &Cpu::Op_LD_SP_HL;
+		}
+		else if constexpr (z == 2)
+		{
+			if constexpr (y < 4) return &Cpu::Op_JP<y>;
+			else if constexpr (y == 4) return &Cpu::Op_LDH_C_A;
+			else if constexpr (y == 5) return &Cpu::Op_LD_nn_A;
+			else if constexpr (y == 6) return &Cpu::Op_LDH_A_C;
+			else return &Cpu::Op_LD_A_nn;
+		}
+		else if constexpr (z == 3)
+		{
+			if constexpr (y == 0) return &Cpu::Op_JP<4>;
+			else if constexpr (y == 1) return &Cpu::Op_CB;
+			else if constexpr (y == 6) return &Cpu::Op_DI;
+			else if constexpr (y == 7) return &Cpu::Op_EI;
+			else return &Cpu::Op_Undefined<op>;
+		}
+		else if constexpr (z == 4)
+		{
+			if constexpr (y < 4) return &Cpu::Op_CALL<y>;
+			else return &Cpu::Op_Undefined<op>;
+		}
+		else if constexpr (z == 5)
+		{
+			if constexpr (q == 0) return &Cpu::Op_PUSH<p>;
+			else if constexpr (p == 0) return &Cpu::Op_CALL<4>;
+			else return &Cpu::Op_Undefined<op>;
+		}
+		else if constexpr (z == 6) return &Cpu::Op_ALU<y, 8>;
+		else return &Cpu::Op_RST<y * 8>;
+	}
+}
+
+template<uint8_t op>
+constexpr Cpu::OpHandler Cpu::DecodeCB()
+{
+	constexpr uint8_t x = op >> 6;
+	constexpr uint8_t y = (op >> 3) & 7;
+	constexpr uint8_t z = op & 7;
+
+	if constexpr (x == 0) return &Cpu::Op_CB_Rot<y, z>;
+	else if constexpr (x == 1) return &Cpu::Op_CB_BIT<y, z>;
+	else if constexpr (x == 2) return &Cpu::Op_CB_RES<y, z>;
+	else return &Cpu::Op_CB_SET<y, z>;
+}
+
+template<size_t... ops>
+constexpr std::array<Cpu::OpHandler, sizeof...(ops)> Cpu::BuildOpTable(std::index_sequence<ops...>)
+{
+	return { { DecodeOp<ops>()... } };
+}
+
+template<size_t... ops>
+constexpr std::array<Cpu::OpHandler, sizeof...(ops)> Cpu::BuildCBTable(std::index_sequence<ops...>)
+{
+	return { { DecodeCB<ops>()... } };
+}
+
+const std::array<Cpu::OpHandler, 256> Cpu::OpTable = Cpu::BuildOpTable(std::make_index_sequence<256>());
+const std::array<Cpu::OpHandler, 256> Cpu::CBTable = Cpu::BuildCBTable(std::make_index_sequence<256>());
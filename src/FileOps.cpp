@@ -0,0 +1,70 @@
+#include "FileOps.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+const uint8_t* MapFile(const std::string& filename, size_t& size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return nullptr;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+        return nullptr;
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); //the view keeps the mapping alive
+    if (data == NULL)
+        return nullptr;
+
+    size = (size_t)fileSize.QuadPart;
+    return (const uint8_t*)data;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); //the mapping keeps the file open
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    size = (size_t)st.st_size;
+    return (const uint8_t*)data;
+#endif
+}
+
+void UnmapFile(const uint8_t* data, size_t size)
+{
+    if (!data)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void*)data, size);
+#endif
+}
@@ -0,0 +1,25 @@
+#include "FrameExchange.h"
+#include <cstring>
+
+FrameExchange::FrameExchange()
+{
+	memset(buffers, 0xFF, sizeof(buffers));
+}
+
+uint32_t* FrameExchange::GetBackBuffer()
+{
+	return buffers[back];
+}
+
+void FrameExchange::Publish()
+{
+	back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 0x03;
+}
+
+const uint32_t* FrameExchange::TakeLatest()
+{
+	if (!(middle.load(std::memory_order_relaxed) & FRESH))
+		return nullptr;
+	front = middle.exchange(front, std::memory_order_acq_rel) & 0x03;
+	return buffers[front];
+}
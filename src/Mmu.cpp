@@ -17,10 +17,43 @@
 //FF80 	FFFE 	High RAM(HRAM)
 //FFFF 	FFFF 	Interrupts Enable Register(IE)
 
+//the rom before one is loaded, two banks of zeros
+const uint8_t Mmu::EmptyRom[0x8000] = { 0 };
+
 Mmu::Mmu(Apu* __apu, Serial* __lc) : apu(__apu), linkCable(__lc)
 {
 	//memset(Memory, 0xFF, sizeof(Memory));
 	Memory[0xFF00] = 0xFF; //stub initial input to all buttons released
+
+	for (uint16_t addr = 0xFF00; addr < 0xFF80; addr++)
+		RegisterIoHandler(addr, &Mmu::ReadIoMemory, &Mmu::WriteIoMemory, this);
+	RegisterIoHandler(0xFF00, &Mmu::ReadJoypad, &Mmu::WriteJoypad, this);
+	RegisterIoHandler(0xFF01, &Mmu::ReadIoMemory, &Mmu::WriteSerial, this);
+	RegisterIoHandler(0xFF02, &Mmu::ReadIoMemory, &Mmu::WriteSerial, this);
+	for (uint16_t addr = 0xFF04; addr <= 0xFF07; addr++)
+		RegisterIoHandler(addr, &Timer::ReadRegister, &Timer::WriteRegister, &timer);
+	RegisterIoHandler(0xFF0F, &Mmu::ReadIoMemory, &Mmu::WriteIF, this);
+	RegisterApu(apu);
+	RegisterIoHandler(0xFF41, &Mmu::ReadIoMemory, &Mmu::WriteSTAT, this);
+	RegisterIoHandler(0xFF44, &Mmu::ReadIoMemory, &Mmu::WriteIoReadOnly, this);
+	RegisterIoHandler(0xFF46, &Mmu::ReadIoMemory, &Mmu::WriteDMA, this);
+	RegisterIoHandler(0xFF4D, &Mmu::ReadIoMemory, &Mmu::WriteKEY1, this);
+	RegisterIoHandler(0xFF4F, &Mmu::ReadIoMemory, &Mmu::WriteVBK, this);
+	RegisterIoHandler(0xFF50, &Mmu::ReadIoMemory, &Mmu::WriteBootRomDisable, this);
+	for (uint16_t addr = 0xFF51; addr <= 0xFF55; addr++)
+		RegisterIoHandler(addr, &Mmu::ReadIoMemory, &Mmu::WriteHDMA, this);
+	RegisterIoHandler(0xFF69, &Mmu::ReadPaletteData, &Mmu::WritePaletteData, this);
+	RegisterIoHandler(0xFF6B, &Mmu::ReadPaletteData, &Mmu::WritePaletteData, this);
+	RegisterIoHandler(0xFF70, &Mmu::ReadIoMemory, &Mmu::WriteSVBK, this);
+
+	UseMBC<NOMBC>();
+	UpdatePageTable();
+	SetColorCorrection(COLOR_LCD);
+}
+
+Mmu::~Mmu()
+{
+	UnmapFile(mappedRom, mappedRomSize);
 }
 
 
@@ -100,6 +133,7 @@ void Mmu::Tick(uint16_t cycles)
 			Memory[0xFF02] = 0x7C;
 			//trigger a serial interrupt
 			Memory[0xFF0F] |= 0x08;
+			UpdatePendingInterrupts();
 		}
 	}
 
@@ -118,7 +152,10 @@ void Mmu::Tick(uint16_t cycles)
 		if (DMACycles < 8)
 			continue;
 		if (DMACycles % 4 == 0)
+		{
 			Memory[0xFE00 + (DMACycles / 4) - 2] = ReadByteDirect(DMABaseAddr + (DMACycles / 4) - 2);
+			oamChanged = true;
+		}
 	}
 	if (DMACycles >= 644)
 	{
@@ -129,6 +166,13 @@ void Mmu::Tick(uint16_t cycles)
 
 uint8_t Mmu::ReadByte(uint16_t addr)
 {
+	const uint8_t* page = readPages[addr >> 8];
+	if (page && !DMAInProgress)
+		return page[addr & 0xFF];
+#if KGB_SCHEDULER
+	if (scheduler && IsTimedAddress(addr))
+		scheduler->Sync();
+#endif
 	if (DMAInProgress && addr < 0xFF80) //DMA conflict on bus and not in HRAM
 	{
 		return ReadByteDirect(DMABaseAddr + (DMACycles / 4) - 2);
@@ -139,24 +183,18 @@ uint8_t Mmu::ReadByte(uint16_t addr)
 
 uint8_t Mmu::ReadByteDirect(uint16_t addr)
 {
+	const uint8_t* page = readPages[addr >> 8];
+	if (page)
+		return page[addr & 0xFF];
+
 	if (addr < 0x100 && bootRomEnabled && (!cgbMode)) //DMG Boot Rom
 		return DMGBootROM[addr];
 	if (((addr < 0x100) || addr > 0x1FF && addr < 0x900 ) && bootRomEnabled && (cgbMode)) //CGB Boot Rom
 		return CGBBootROM[addr];
 	if (addr < 0x4000) //ROM, Bank 0
-	{
-		if (currentMBC == MBC1 && mbc1Mode == 0x01 && totalRomBanks > 0x20)
-		{
-			return ROM[0x4000 * ((hiBank << 5) % totalRomBanks) + (addr)];
-		}
-		//MBC3 and MBC5 always maps bank 00 here
-
-		return ROM[addr];
-	}
+		return ROM[romBank0Offset + addr];
 	if (addr < 0x8000) //ROM, bank N
-	{
-		return ROM[(0x4000 * (currentRomBank % totalRomBanks)) + (addr - 0x4000)];
-	}
+		return ROM[romBankNOffset + (addr - 0x4000)];
 	if (addr < 0xA000) //VRAM
 	{
 		//if (currentPPUMode != 3)
@@ -166,58 +204,7 @@ uint8_t Mmu::ReadByteDirect(uint16_t addr)
 		//return 0xFF;
 	}
 	if (addr > 0x9FFF && addr < 0xC000) //external cartridge ram (possibly banked)
-	{
-		if (doesRTCExist && isRTCEnabled && (mappedRTCReg < RTCREGS::NONE))
-		{
-			if (isRTCLatched)
-			{
-				return latchedRtcRegValues[mappedRTCReg];
-			}
-			else
-			{
-				return rtcRegValues[mappedRTCReg];
-			}
-		}
-		if (!isCartRamEnabled)
-			return 0xFF;
-		switch (currentMBC)
-		{
-		case(MBC1):
-		{
-			if (totalRamBanks > 1 && mbc1Mode == 1)
-				return ReadCartRam((uint32_t)((uint32_t)hiBank << 13) + (addr & 0x1FFF));
-			else if (totalRamBanks)
-				return ReadCartRam((addr & 0x1FFF));
-			return 0xFF;
-			break;
-		}
-		case(MBC2):
-		{
-			return ReadCartRam((addr & 0x01FF));
-			break;
-		}
-		case(MBC3):
-		{
-			if (totalRamBanks > 1)
-				return ReadCartRam((uint32_t)((uint32_t)hiBank << 13) + (addr & 0x1FFF));
-			else if (totalRamBanks)
-				return ReadCartRam((addr & 0x1FFF));
-			return 0xFF;
-			break;
-		case(MBC5):
-		{
-			if (totalRamBanks > 1)
-				return ReadCartRam((uint32_t)((uint32_t)currentRamBank << 13) + (addr & 0x1FFF));
-			else if (totalRamBanks)
-				return ReadCartRam((addr & 0x1FFF));
-			return 0xFF;
-			break;
-		}
-		}
-		default:
-			break;
-		}
-	}
+		return (this->*readCartArea)(addr);
 	if (addr > 0xBFFF && addr < 0xD000) //WRAM bank 0
 	{
 		return WRAM[0][addr & 0x0FFF];
@@ -231,552 +218,229 @@ uint8_t Mmu::ReadByteDirect(uint16_t addr)
 	if (addr > 0xFE9F && addr < 0xFF00) // prohibited area. todo: during OAM, return FF and trigger sprite bug. else return 00
 		return 0x00; 
 
-	if (addr == 0xFF00) // joypad
+	if (addr >= 0xFF00 && addr < 0xFF80) //io registers
 	{
-		uint8_t value = Memory[0xFF00];
-
-		if (!(value & 0x20)) //buttons selected
-		{
-			value &= 0xF0 | Joypad.buttons;
-		}
-		else if (!(value & 0x10)) //directions selected
-		{
-			value &= 0xF0 | Joypad.directions;
-		}
-
-		return value;
+		IoHandler& handler = ioHandlers[addr & 0x7F];
+		return handler.read(handler.user, addr) | IoReadMask[addr & 0x7F];
 	}
 
-	if (addr == 0xFF01)
-	{
-		return Memory[0xFF01];
-	}
-	if (addr == 0xFF02)
+	return Memory[addr]; //just return the mapped memory
+}
+
+//Find the physical location of addr for the cpu's block cache, mirroring the mapping in ReadByteDirect.
+//Returns false for anything that isn't plain rom or ram (boot rom, vram, echo ram, oam, io, rtc registers, disabled cart ram)
+bool Mmu::GetCodeKey(uint16_t addr, uint32_t& key)
+{
+	if (bootRomEnabled)
+		return false;
+	if (addr < 0x4000) //ROM, Bank 0
 	{
-		return Memory[0xFF02];
+		key = romBank0Offset + addr;
+		return true;
 	}
-	if (addr >= 0xFF10 && addr <= 0xFF3F)
+	if (addr < 0x8000) //ROM, bank N
 	{
-		switch (addr)
-		{
-		case(0xFF10):
-			return Memory[addr] | 0x80;
-		case(0xFF11):
-			return Memory[addr] | 0x3F;
-		case(0xFF12):
-			return Memory[addr];
-		case(0xFF13):
-			return 0xFF;
-		case(0xFF14):
-			return Memory[addr] | 0xBF;
-		case(0xFF15):
-			return 0xFF;
-		case(0xFF16):
-			return Memory[addr] | 0x3F;
-		case(0xFF17):
-			return Memory[addr];
-		case(0xFF18):
-			return 0xFF;
-		case(0xFF19):
-			return Memory[addr] | 0xBF;
-		case(0xFF1A):
-			return Memory[addr] | 0x7F;
-		case(0xFF1B):
-			return 0xFF;
-		case(0xFF1C):
-			return Memory[addr] | 0x9F;
-		case(0xFF1D):
-			return 0xFF;
-		case(0xFF1E):
-			return Memory[addr] | 0xBF;
-		case(0xFF1F):
-			return 0xFF;
-		case(0xFF20):
-			return 0xFF;
-		case(0xFF21):
-			return Memory[addr];
-		case(0xFF22):
-			return Memory[addr];
-		case(0xFF23):
-			return Memory[addr] | 0xBF;
-		case(0xFF24):
-			return Memory[addr];
-		case(0xFF25):
-			return Memory[addr];
-		case(0xFF26):
-			if (apu)
-			{
-				return apu->GetAudioEnable() | 0x70;
-			}
-			return Memory[addr] | 0x70;
-		case(0xFF27):
-		case(0xFF28):
-		case(0xFF29):
-		case(0xFF2A):
-		case(0xFF2B):
-		case(0xFF2C):
-		case(0xFF2D):
-		case(0xFF2E):
-		case(0xFF2F):
-			return 0xFF;
-		case(0xFF30):
-		case(0xFF31):
-		case(0xFF32):
-		case(0xFF33):
-		case(0xFF34):
-		case(0xFF35):
-		case(0xFF36):
-		case(0xFF37):
-		case(0xFF38):
-		case(0xFF39):
-		case(0xFF3A):
-		case(0xFF3B):
-		case(0xFF3C):
-		case(0xFF3D):
-		case(0xFF3E):
-		case(0xFF3F):
-			return Memory[addr];
-		default:
-			return 0xFF;
-		}
+		key = romBankNOffset + (addr - 0x4000);
+		return true;
 	}
-
-	if (addr == 0xFF40)
+	if (addr > 0x9FFF && addr < 0xC000) //external cartridge ram
 	{
-		return Memory[addr];
+		uint16_t offset;
+		if (!(this->*getCartRamOffset)(addr, offset) || CartRam.size() < (size_t)offset + 1)
+			return false;
+		key = CODEKEY_CARTRAM + offset;
+		return true;
 	}
-
-	if (addr == 0xFF41)
+	if (addr > 0xBFFF && addr < 0xD000) //WRAM bank 0
 	{
-		return Memory[addr];
+		key = CODEKEY_WRAM + (addr & 0x0FFF);
+		return true;
 	}
-
-	if (addr == 0xFF69) //read CGB BGPD
+	if (addr > 0xCFFF && addr < 0xE000) //WRAM high bank
 	{
-		return cgb_BGP[Memory[0xFF68] & 0x3F];
+		key = CODEKEY_WRAM + (currentWRAMBank << 12) + (addr & 0x0FFF);
+		return true;
 	}
-
-	if (addr == 0xFF6B) //read CGB OBPD
+	if (addr > 0xFF7F && addr < 0xFFFF) //HRAM
 	{
-		return cgb_OBP[Memory[0xFF6A] & 0x3F];
+		key = CODEKEY_HRAM + (addr - 0xFF80);
+		return true;
 	}
-
-	return Memory[addr]; //just return the mapped memory
+	return false;
 }
 
-void Mmu::WriteByte(uint16_t addr, uint8_t val)
+//Flag the ram page behind key as holding cached code, so writes to it can invalidate the cache
+void Mmu::MarkCodePage(uint32_t key)
 {
-	if (addr < 0x8000) // ROM area. todo: should be handled by the MBC
+	if (key >= CODEKEY_WRAM && !codePages[(key - CODEKEY_WRAM) >> 8])
 	{
-		switch (currentMBC)
-		{
-		case(MBC_TYPE::MBC1):
-			WriteMBC1(addr, val);
-			return;
-		case(MBC_TYPE::MBC2):
-			WriteMBC2(addr, val);
-			return;
-		case(MBC_TYPE::MBC3):
-			WriteMBC3(addr, val);
-			return;
-		case(MBC_TYPE::MBC5):
-			WriteMBC5(addr, val);
-			return;
-		case(MBC_TYPE::NOMBC):
-		case(MBC_TYPE::UNKNOWN):
-		default:
-			//std::cout << "Blocked write to 0x" << std::hex << std::setfill('0') << std::uppercase << std::setw(4) << addr << std::endl;
-			return;
-		}
-	}
-
-	if (addr > 0x7FFF && addr < 0xA000) //VRAM
-	{
-		//if (currentPPUMode != 3)
-			VRAM[currentVRAMBank][addr & 0x1FFF] = val;
-		//else
-		//	std::cout << "Error: write to VRAM during Mode 3" << std::endl;
-		//return;
-	}
-
-	if (addr > 0xBFFF && addr < 0xD000) //WRAM bank 0
-	{
-		WRAM[0][addr & 0x0FFF] = val;
-		return;
-	}
-	if (addr > 0xCFFF && addr < 0xE000) //WRAM high bank (cgb mode), WRAM bank 1 in DMG mode
-	{
-		WRAM[currentWRAMBank][addr & 0x0FFF] = val;
-		return;
+		codePages[(key - CODEKEY_WRAM) >> 8] = 1;
+		UpdateCodePageWrites((key - CODEKEY_WRAM) >> 8); //writes to the page have to go through CheckCodeWrite now
 	}
+}
 
-	if (addr >= 0xFE00 && addr <= 0xFE9F) // OAM
+void Mmu::CheckCodeWrite(uint32_t key)
+{
+	uint16_t codePage = (key - CODEKEY_WRAM) >> 8;
+	if (codePages[codePage])
 	{
-		Memory[addr] = val;
-		return;
+		codePages[codePage] = 0; //the cpu drops the blocks on this page, so it's clean again until code is decoded there
+		writtenCodePages.push_back(codePage);
+		UpdateCodePageWrites(codePage);
 	}
+}
 
-	if (addr == 0xFF00) //joypad input
-	{
-		uint8_t joypadSelect = val & 0x30; //get only the 2 bits for mode select
-		Memory[0xFF00] &= 0xCF; // clear the 2 select bits. 0xFF00 & 1100 1111
-		Memory[0xFF00] |= joypadSelect; //set the new joypad mode
-		return;
-	}
-	
-	if (addr == 0xFF01)
-	{
-		//std::cout << (char)val << std::flush;
-		Memory[addr] = val;
-		if (linkCable)
-			linkCable->SB = val;
-		return;
-	}
-	if (addr == 0xFF02)
-	{
-		if ((val & 0x81) == 0x81)
+//Patch the write pages showing one ram code page after its flag has changed, so they go straight to memory while it's
+//clean and through CheckCodeWrite while it holds code. Cheaper than rebuilding the whole table on every code write
+void Mmu::UpdateCodePageWrites(uint16_t codePage)
+{
+	if (codePage < 0x80)
+	{
+		//wram. Bank 0 is always at C000, the others only while they're switched in at D000
+		uint8_t bank = codePage >> 4;
+		uint8_t* mem = &WRAM[bank][(codePage & 0x0F) << 8];
+		uint8_t* write = codePages[codePage] ? nullptr : mem;
+		if (bank == 0)
+			writePages[0xC0 + (codePage & 0x0F)] = write;
+		if (bank == currentWRAMBank)
+			writePages[0xD0 + (codePage & 0x0F)] = write;
+	}
+	else if (codePage >= ((CODEKEY_CARTRAM - CODEKEY_WRAM) >> 8) && currentMBC != MBC2)
+	{
+		//cart ram, wherever the current bank has put it. Unmapped or disabled pages have no read page either
+		uint8_t* mem = CartRam.data() + ((codePage - ((CODEKEY_CARTRAM - CODEKEY_WRAM) >> 8)) << 8);
+		for (int page = 0xA0; page < 0xC0; page++)
 		{
-			if (linkCable)
-			{
-				if (linkCable->IsConnected())
-				{
-					if (!linkCable->expectingResponse)
-					{
-						linkCable->expectingResponse = true;
-						linkCable->outgoingQueue.push(linkCable->SB);
-					}
-				}
-				else
-				{
-					linkCable->incomingQueue.push(0xFF);
-				}
-			}
-			else
-			{
-				//std::cout << (char)Memory[0xFF01] << std::flush;
-				Memory[0xFF01] = 0xFF;
-			}
+			if (readPages[page] == mem)
+				writePages[page] = codePages[codePage] ? nullptr : mem;
 		}
-		Memory[addr] = cgbSupport ? (val | 0x7C) : (val | 0x7E);
-		return;
 	}
+	//hram isn't in the page table, its writes always take the long way
+}
 
-	if (addr == 0xFF04) //DIV timer register, set to 0 on write
-	{
-		master_clock = 0;
-		Memory[0xFF04] = 0;
-		return;
-	}
+void Mmu::UpdatePageTable()
+{
+	readPages.fill(nullptr);
+	writePages.fill(nullptr);
 
-	if (addr == 0xFF05) //tima
+	//ROM, bank 0 and bank N
+	romBank0Offset = 0;
+	if (currentMBC == MBC1 && mbc1Mode == 0x01 && totalRomBanks > 0x20)
+		romBank0Offset = 0x4000 * ((hiBank << 5) % totalRomBanks);
+	romBankNOffset = 0x4000 * (currentRomBank % totalRomBanks);
+	for (int page = 0x00; page < 0x40; page++)
 	{
-		Memory[0xFF05] = val;
-		return;
+		readPages[page] = &ROM[romBank0Offset + (page << 8)];
+		readPages[page + 0x40] = &ROM[romBankNOffset + (page << 8)];
 	}
-
-	if (addr >= 0xFF10 && addr <= 0xFF2F) //apu regs
+	if (bootRomEnabled)
 	{
-		if (addr == 0xFF26)
+		if (!cgbMode)
+			readPages[0x00] = &DMGBootROM[0];
+		else
 		{
-			//Bit 7 - All sound on / off(0: stop all sound circuits) (Read / Write)
-			//Bit 3 - Sound 4 ON flag(Read Only)
-			//Bit 2 - Sound 3 ON flag(Read Only)
-			//Bit 1 - Sound 2 ON flag(Read Only)
-			//Bit 0 - Sound 1 ON flag(Read Only)
-			if (val & 0x80)
+			for (int page = 0x00; page < 0x09; page++)
 			{
-				if (apu) { apu->SetAudioEnable(true); }
-
-				Memory[0xFF26] |= 0x80;
+				if (page != 0x01) //the cartridge header shows through between the two halves of the cgb boot rom
+					readPages[page] = &CGBBootROM[page << 8];
 			}
-			else
-			{
-				if (apu) { apu->SetAudioEnable(false); }
-				for (int i = 0xFF10; i < 0xFF26; i++)
-					WriteByte(i, 0x00);
-				for (int i = 0xFF27; i < 0xFF30; i++)
-					WriteByte(i, 0x00);
-				Memory[0xFF26] = 0x00;
-			}
-			return;
 		}
-		if (!apu || (((apu->GetAudioEnable() & 0x80) != 0x80) && val != 0x00))
-			return;
-		switch (addr)
-		{
-		case(0xFF10):
-			if (apu) { apu->ChannelOneSetSweep(val); }
-			Memory[0xFF10] = val | 0x80;
-			return;
-		case(0xFF11):
-			if (apu) { apu->ChannelOneSetLength(val); }
-			Memory[0xFF11] = val | 0x3F;
-			return;
-		case(0xFF12):
-			if (apu) { apu->ChannelOneSetVolume(val); }
-			Memory[0xFF12] = val;
-			return;
-		case(0xFF13):
-			//Frequency's lower 8 bits of 11 bit data (x). Next 3 bits are in NR24 ($FF19).
-			if (apu) { apu->ChannelOneSetFreq(val); }
-			Memory[0xFF13] = val;
-			return;
-		case(0xFF14):
-			if (apu) { apu->ChannelOneTrigger(val); }
-			Memory[0xFF14] = val | 0xBF;
-			return;
-		case(0xFF15):
-			Memory[addr] = val;
-			return;
-		case(0xFF16):
-			if (apu) { apu->ChannelTwoSetLength(val); }
-			Memory[0xFF16] = val | 0x3F;
-			return;
-		case(0xFF17):
-			if (apu) { apu->ChannelTwoSetVolume(val); }
-			Memory[0xFF17] = val;
-			return;
-		case(0xFF18):
-			//Frequency's lower 8 bits of 11 bit data (x). Next 3 bits are in NR24 ($FF19).
-			if (apu) { apu->ChannelTwoSetFreq(val); }
-			Memory[0xFF18] = val;
-			return;
-		case(0xFF19):
-			if (apu) { apu->ChannelTwoTrigger(val); }
-			Memory[0xFF19] = (val & 0x40) | 0xBF;
-			return;
-		case(0xFF1A):
-			if (apu) { apu->ChannelThreeSetEnable(val); }
-			Memory[0xFF1A] = val | 0x7F;
-			return;
-		case(0xFF1B):
-			if (apu) { apu->ChannelThreeSetLength(val); }
-			Memory[0xFF1B] = val;
-			return;
-		case(0xFF1C):
-			if (apu) { apu->ChannelThreeSetVolume(val); }
-			Memory[0xFF1C] = val | 0x9F;
-			return;
-		case(0xFF1D):
-			if (apu) { apu->ChannelThreeSetFreq(val); }
-			Memory[0xFF1D] = val;
-			return;
-		case(0xFF1E):
-			if (apu) { apu->ChannelThreeTrigger(val); }
-			Memory[0xFF1E] = val | 0xBF;
-			return;
-		case(0xFF1F):
-			Memory[addr] = val;
-			return;
-		case(0xFF20):
-			if (apu) { apu->ChannelFourSetLength(val); }
-			Memory[addr] = val | 0xC0;
-			return;
-		case(0xFF21):
-			if (apu) { apu->ChannelFourSetVolume(val); }
-			Memory[addr] = val;
-			return;
-		case(0xFF22):
-			if (apu) { apu->ChannelFourSetPoly(val); }
-			Memory[addr] = val;
-			return;
-		case(0xFF23):
-			if (apu) { apu->ChannelFourTrigger(val); }
-			Memory[addr] = val | 0xBF;
-			return;
-		case(0xFF24):
-			if (apu) { apu->SetMasterVolume(val); }
-			Memory[addr] = val;
-			return;
-		case(0xFF25):
-			if (apu) { apu->SetPan(val); }
-			Memory[addr] = val;
-			return;
-		case(0xFF27):
-			Memory[addr] = val;
-			return;
-		case(0xFF28):
-			Memory[addr] = val;
-			return;
-		case(0xFF29):
-			Memory[addr] = val;
-			return;
-		case(0xFF2A):
-			Memory[addr] = val;
-			return;
-		case(0xFF2B):
-			Memory[addr] = val;
-			return;
-		case(0xFF2C):
-			Memory[addr] = val;
-			return;
-		case(0xFF2D):
-			Memory[addr] = val;
-			return;
-		case(0xFF2E):
-			Memory[addr] = val;
-			return;
-		case(0xFF2F):
-			Memory[addr] = val;
-			return;
-
-		default:
-			return;
-		}
-	}
-
-	if (addr >= 0xFF30 && addr <= 0xFF3F) //wave ram
-	{
-		if (apu) { apu->SetWaveRam(addr & 0x000F, val); }
-		Memory[addr] = val;
-		return;
 	}
 
-	if (addr == 0xFF40)
+	//VRAM. Writes to the tile data have to mark the tile cache, only the maps can be written directly, and not even those
+	//while they're being journaled
+	for (int page = 0x80; page < 0xA0; page++)
 	{
-		Memory[0xFF40] = val;
-		return;
+		readPages[page] = &VRAM[currentVRAMBank][(page & 0x1F) << 8];
+		if (page >= 0x98 && !vramJournal)
+			writePages[page] = &VRAM[currentVRAMBank][(page & 0x1F) << 8];
 	}
 
-
-	if (addr == 0xFF41) //lcd stat
+	//external cartridge ram. MBC2 only keeps the low nibble on writes, so those always take the long way
+	for (int page = 0xA0; page < 0xC0; page++)
 	{
-		Memory[0xFF41] = (val & 0xF8) | (Memory[0xFF41] & 0x07); //mask off the bottom 3 bits which are read only
-		return;
+		uint16_t offset;
+		if (!(this->*getCartRamOffset)(page << 8, offset) || CartRam.size() < (size_t)offset + 0x100)
+			continue;
+		readPages[page] = &CartRam[offset];
+		if (currentMBC != MBC2 && !codePages[(CODEKEY_CARTRAM - CODEKEY_WRAM + offset) >> 8])
+			writePages[page] = &CartRam[offset];
 	}
 
-	if (addr == 0xFF44) //LY, read only
-		return;
-
-	if (addr == 0xFF46) //DMA control
+	//WRAM, bank 0 and the high bank
+	for (int page = 0xC0; page < 0xE0; page++)
 	{
-		Memory[0xFF46] = val;
-		DMABaseAddr = val << 8;
-		DMACycles = 0;
-		DMAInProgress = true;
-		return;
+		uint8_t bank = (page < 0xD0) ? 0 : currentWRAMBank;
+		readPages[page] = &WRAM[bank][(page & 0x0F) << 8];
+		if (!codePages[(bank << 4) + (page & 0x0F)])
+			writePages[page] = &WRAM[bank][(page & 0x0F) << 8];
 	}
 
-	if (addr == 0xFF4D) //prep speed switch. cgb only
+	//echo ram
+	for (int page = 0xE0; page < 0xFE; page++)
 	{
-		Memory[0xFF4D] &= 0x80;
-		Memory[0xFF4D] |= 0x7E;
-		Memory[0xFF4D] |= (val & 0x01);
-		return;
+		writePages[page] = &Memory[(page - 0x20) << 8];
+		readPages[page] = writePages[page];
 	}
+}
 
-	if (addr == 0xFF4F)
+void Mmu::WriteByte(uint16_t addr, uint8_t val)
+{
+	uint8_t* page = writePages[addr >> 8];
+	if (page)
 	{
-		currentVRAMBank = val & 0x01;
-		Memory[0xFF4F] = 0xFE | currentVRAMBank;
+		page[addr & 0xFF] = val;
 		return;
 	}
-
-	if (addr == 0xFF50) //Bootrom enable. Zero on startup. Non-zero disables bootrom
+#if KGB_SCHEDULER
+	if (scheduler && IsTimedAddress(addr))
 	{
-		if (bootRomEnabled && (val & 0x01))
-		{
-			bootRomEnabled = false;
-			Memory[0xFF50] = 0xFF;
-
-			//if (cgbMode && (!cgbSupport))
-			//{
-			//	cgbMode = false;
-			//}
-		}
-		return;
+		scheduler->Sync();
+		scheduler->RegisterWritten();
 	}
-
-	if (addr == 0xFF51) //HDMA1 Src Addr High Byte
+#endif
+	if (addr < 0x8000) // ROM area, the mbc registers
 	{
-		Memory[0xFF51] = val;
+		mapGeneration++;
+		(this->*writeMBC)(addr, val);
 		return;
 	}
 
-	if (addr == 0xFF52) //HDMA2 Src Addr Low Byte
+	if (addr > 0x7FFF && addr < 0xA000) //VRAM
 	{
-		Memory[0xFF52] = val & 0xF0;
-		return;
+		//if (currentPPUMode != 3)
+			VRAM[currentVRAMBank][addr & 0x1FFF] = val;
+		//else
+		//	std::cout << "Error: write to VRAM during Mode 3" << std::endl;
+		//return;
+		tileCache.Invalidate(currentVRAMBank, addr & 0x1FFF);
+		JournalVRAM(currentVRAMBank, addr & 0x1FFF, 1);
 	}
 
-	if (addr == 0xFF53) //HDMA3 Dest High Byte
+	if (addr > 0xBFFF && addr < 0xD000) //WRAM bank 0
 	{
-		Memory[0xFF53] = val & 0x1F;
+		WRAM[0][addr & 0x0FFF] = val;
+		CheckCodeWrite(CODEKEY_WRAM + (addr & 0x0FFF));
 		return;
 	}
-
-	if (addr == 0xFF54) //HDMA4 Dest Low Byte
+	if (addr > 0xCFFF && addr < 0xE000) //WRAM high bank (cgb mode), WRAM bank 1 in DMG mode
 	{
-		Memory[0xFF54] = val & 0xF0;
+		WRAM[currentWRAMBank][addr & 0x0FFF] = val;
+		CheckCodeWrite(CODEKEY_WRAM + (currentWRAMBank << 12) + (addr & 0x0FFF));
 		return;
 	}
 
-	if (addr == 0xFF55) //HDMA5 start/stop/length
-	{
-		//Memory[0xFF55] = val;
-		if (val & 0x80) //start h-blank dma
-		{
-			HDMAInProgress = true;
-			HDMATransferredTotal = 0;
-			HDMATransferredThisLine = 0;
-			HDMALength = ((val & 0x7F) + 1) << 4;
-			HDMASrcAddr = ((uint16_t)Memory[0xFF51] << 8) | Memory[0xFF52];
-			HDMADestAddr = (((uint16_t)Memory[0xFF53] << 8) | Memory[0xFF54]) & 0x1FFF;
-			Memory[0xFF55] = val & 0x7F;
-			return;
-		}
-		else
-		{
-			if (HDMAInProgress) //stop h-blank dma
-			{
-				HDMAInProgress = false;
-				Memory[0xFF55] |= 0x80;
-				return;
-			}
-			else //perform general dma
-			{
-				uint16_t src = ((uint16_t)Memory[0xFF51] << 8) | Memory[0xFF52];
-				uint16_t dest = (((uint16_t)Memory[0xFF53] << 8) | Memory[0xFF54]) & 0x1FFF;
-
-				uint16_t length = ((val & 0x7F) + 1) << 4;
-
-				for (uint16_t i = 0; i < length; i++)
-				{
-					VRAM[currentVRAMBank][dest + i] = ReadByteDirect(src + i);
-				}
-				Memory[0xFF55] = 0xFF;
-				return;
-			}
-		}
-	}
-
-	if (addr == 0xFF69) //write to CGB BGPD
+	if (addr >= 0xFE00 && addr <= 0xFE9F) // OAM
 	{
-		cgb_BGP[Memory[0xFF68] & 0x3F] = val;
-		if (Memory[0xFF68] & 0x80)
-		{
-			Memory[0xFF68] = (((Memory[0xFF68] & 0x3F) + 1) & 0x3F) | 0x80; //increment palette index
-		}
+		Memory[addr] = val;
+		oamChanged = true;
 		return;
 	}
 
-	if (addr == 0xFF6B) //write to CGB OBPD
+	if (addr >= 0xFF00 && addr < 0xFF80) //io registers
 	{
-		cgb_OBP[Memory[0xFF6A] & 0x3F] = val;
-		if (Memory[0xFF6A] & 0x80)
-		{
-			Memory[0xFF6A] = (((Memory[0xFF6A] & 0x3F) + 1) & 0x3F) | 0x80; //increment palette index
-		}
-		return;
-	}
-
-	if (addr == 0xFF70) //wram bank (cgb only)
-	{
-		currentWRAMBank = val & 0x07;
-		if (currentWRAMBank == 0)
-			currentWRAMBank = 1;
-
-		Memory[0xFF70] = 0xF8 | currentWRAMBank;
+		IoHandler& handler = ioHandlers[addr & 0x7F];
+		handler.write(handler.user, addr, val);
 		return;
 	}
 
@@ -791,67 +455,31 @@ void Mmu::WriteByte(uint16_t addr, uint8_t val)
 
 	if (addr >= 0xA000 && addr < 0xC000) //external cartridge ram
 	{
-		if (currentMBC == MBC1 && isCartRamEnabled)
-		{
-			if (totalRamBanks > 1 && mbc1Mode == 1)
-				WriteCartRam(((uint16_t)(hiBank) << 13) + (addr & 0x1FFF), val);
-			else if (totalRamBanks)
-				WriteCartRam((addr & 0x1FFF), val);
-		}
-		if (currentMBC == MBC2 && isCartRamEnabled)
-		{
-			WriteCartRam((addr & 0x01FF), ((val & 0x0F) | 0xF0));
-		}
-		if (currentMBC == MBC3)
-		{
-			if (doesRTCExist && isRTCEnabled && (mappedRTCReg < RTCREGS::NONE))
-			{
-				switch (mappedRTCReg)
-				{
-				case(RTCREGS::S):
-					rtc_ticks = 0;
-				case(RTCREGS::M):
-					rtcRegValues[mappedRTCReg] = val & 0x3F;
-					break;
-				case(RTCREGS::H):
-					rtcRegValues[mappedRTCReg] = val & 0x1F;
-					break;
-				case(RTCREGS::DL):
-					rtcRegValues[mappedRTCReg] = val;
-					break;
-				case(RTCREGS::DH):
-					rtcRegValues[mappedRTCReg] = val & 0xC1;
-					break;
-				default:
-					break;
-				}
-			}
-			else if (isCartRamEnabled)
-			{
-				if (totalRamBanks > 1)
-					WriteCartRam(((uint16_t)(hiBank) << 13) + (addr & 0x1FFF), val);
-				else if (totalRamBanks)
-					WriteCartRam((addr & 0x1FFF), val);
-			}
-		}
-		if (currentMBC == MBC5 && isCartRamEnabled)
-		{
-			if (totalRamBanks > 1)
-				WriteCartRam(((uint16_t)(currentRamBank) << 13) + (addr & 0x1FFF), val);
-			else if (totalRamBanks)
-				WriteCartRam((addr & 0x1FFF), val);
-		}
+		(this->*writeCartArea)(addr, val);
 		return;
 	}
 
 	if(addr > 0x7FFF)
 		Memory[addr] = val;
 
+	if (addr > 0xFF7F && addr < 0xFFFF) //HRAM
+		CheckCodeWrite(CODEKEY_HRAM + (addr - 0xFF80));
+
+	if (addr == 0xFFFF)
+		UpdatePendingInterrupts();
+
 	return;
 }
 
 uint16_t Mmu::ReadWord(uint16_t addr)
 {
+	const uint8_t* page = readPages[addr >> 8];
+	if (page && (addr & 0xFF) != 0xFF) //both bytes on the same page
+		return (uint16_t)((page[(addr & 0xFF) + 1] << 8) | page[addr & 0xFF]);
+#if KGB_SCHEDULER
+	if (scheduler && (IsTimedAddress(addr) || IsTimedAddress(addr + 1)))
+		scheduler->Sync();
+#endif
 	return (uint16_t)((ReadByteDirect(addr + 1) << 8) | ReadByteDirect(addr)); //return the 16bit word at addr, flip from little endian to big endian
 }
 
@@ -862,9 +490,37 @@ void Mmu::WriteWord(uint16_t addr, uint16_t val)
 	WriteByte(addr, (uint8_t)(val & 0xFF));
 }
 
-uint8_t* Mmu::GetROM()
+//Map the rom file in place of a copy. Files too short to hold the two banks every cart has get a padded copy instead
+bool Mmu::LoadRom(const std::string& romFileName)
+{
+	UnmapFile(mappedRom, mappedRomSize);
+	mappedRom = MapFile(romFileName, mappedRomSize);
+	if (!mappedRom)
+	{
+		std::cout << "Error mapping rom file: " << romFileName << std::endl;
+		return false;
+	}
+	ROM = mappedRom;
+	romSize = mappedRomSize;
+
+	if (romSize < 0x8000)
+		PadRom(0x8000);
+
+	UpdatePageTable();
+	return true;
+}
+
+//Swap the rom for a zero filled copy of at least size bytes, so banks past the end of the file can still be read
+void Mmu::PadRom(size_t size)
 {
-	return &ROM[0];
+	std::vector<uint8_t> padded(size, 0);
+	std::copy(ROM, ROM + std::min(romSize, size), padded.begin());
+	romCopy.swap(padded);
+	UnmapFile(mappedRom, mappedRomSize);
+	mappedRom = nullptr;
+	mappedRomSize = 0;
+	ROM = romCopy.data();
+	romSize = romCopy.size();
 }
 
 uint8_t* Mmu::GetDMGBootRom()
@@ -880,6 +536,7 @@ uint8_t* Mmu::GetCGBBootRom()
 void Mmu::SetCGBMode(bool enableCGB)
 {
 	cgbMode = enableCGB;
+	UpdatePageTable();
 }
 
 bool Mmu::GetCGBMode()
@@ -897,74 +554,92 @@ uint8_t Mmu::ReadVRAMDirect(uint16_t addr, uint8_t bank)
 	return VRAM[bank][addr & 0x1FFF];
 }
 
-uint32_t Mmu::GetBGPColor(uint8_t paletteNum, uint8_t index)
+uint8_t Mmu::GetVRAMBank()
 {
-	//todo: maybe clean this up so it's less ugly
-	uint16_t nativeColor = (cgb_BGP[(paletteNum * 8) + (index * 2) + 1] << 8) | cgb_BGP[(paletteNum * 8) + (index * 2)];
-	uint32_t finalColor = 0x000000FF;
-
-	//finalColor |= (((nativeColor & 0x1F) << 3) | ((nativeColor & 0x1F) >> 2)) << 24; //red
-	//finalColor |= ((((nativeColor >> 5) & 0x1F) << 3) | (((nativeColor >> 5)  & 0x1F) >> 2)) << 16; //green
-	//finalColor |= ((((nativeColor >> 10) & 0x1F) << 3) | (((nativeColor >> 10) & 0x1F) >> 2)) << 8; //blue
-
-	uint8_t  native_red, native_green, native_blue, uncorr_red, uncorr_green, uncorr_blue;
-	uint16_t temp_red, temp_green, temp_blue;
-
-	native_red = (nativeColor & 0x1F);
-	native_green = ((nativeColor >> 5) & 0x1F);
-	native_blue = ((nativeColor >> 10) & 0x1F);
-
-	uncorr_red = ((native_red << 3) | (native_red >> 2));
-	uncorr_green = ((native_green << 3) | (native_green >> 2));
-	uncorr_blue = ((native_blue << 3) | (native_blue >> 2));
+	return currentVRAMBank;
+}
 
-	temp_red = ((native_red * 26) + (native_green * 4) + (native_blue * 2));
-	temp_green = ((native_green * 24) + (native_blue * 8));
-	temp_blue = ((native_red * 6) + (native_green * 4) + (native_blue * 22));
-	temp_red = std::min((uint16_t)960, temp_red) >> 2;
-	temp_green = std::min((uint16_t)960, temp_green) >> 2;
-	temp_blue = std::min((uint16_t)960, temp_blue) >> 2;
+const std::array<std::array<uint8_t, 0x2000>, 2>& Mmu::GetVRAM()
+{
+	return VRAM;
+}
 
-	finalColor |= (temp_red & 0xFF) << 24;
-	finalColor |= (temp_green & 0xFF) << 16;
-	finalColor |= (temp_blue & 0xFF) << 8;
+void Mmu::SetVRAMJournal(std::vector<uint32_t>* journal)
+{
+	vramJournal = journal;
+	UpdatePageTable();
+}
 
-	return finalColor;
+uint32_t Mmu::GetBGPColor(uint8_t paletteNum, uint8_t index)
+{
+	return cgbColors[(paletteNum * 4) + index];
 }
 
 uint32_t Mmu::GetOBPColor(uint8_t paletteNum, uint8_t index)
 {
-	//todo: maybe clean this up so it's less ugly
-	uint16_t nativeColor = (cgb_OBP[(paletteNum * 8) + (index * 2) + 1] << 8) | cgb_OBP[(paletteNum * 8) + (index * 2)];
-	uint32_t finalColor = 0x000000FF;
+	return cgbColors[32 + (paletteNum * 4) + index];
+}
 
-	//finalColor |= (((nativeColor & 0x1F) << 3) | ((nativeColor & 0x1F) >> 2)) << 24; //red
-	//finalColor |= ((((nativeColor >> 5) & 0x1F) << 3) | (((nativeColor >> 5) & 0x1F) >> 2)) << 16; //green
-	//finalColor |= ((((nativeColor >> 10) & 0x1F) << 3) | (((nativeColor >> 10) & 0x1F) >> 2)) << 8; //blue
+const uint32_t* Mmu::GetPaletteColors()
+{
+	return cgbColors.data();
+}
 
-	uint8_t  native_red, native_green, native_blue, uncorr_red, uncorr_green, uncorr_blue;
-	uint16_t temp_red, temp_green, temp_blue;
+void Mmu::SetColorCorrection(COLOR_CORRECTION mode)
+{
+	colorCorrection = mode;
+
+	for (uint32_t nativeColor = 0; nativeColor < 0x8000; nativeColor++)
+	{
+		uint16_t native_red   = (nativeColor & 0x1F);
+		uint16_t native_green = ((nativeColor >> 5) & 0x1F);
+		uint16_t native_blue  = ((nativeColor >> 10) & 0x1F);
+		uint16_t red, green, blue;
 
-	native_red   = (nativeColor & 0x1F);
-	native_green = ((nativeColor >> 5) & 0x1F);
-	native_blue  = ((nativeColor >> 10) & 0x1F);
+		switch (mode)
+		{
+		case(COLOR_RAW):
+			red   = ((native_red   << 3) | (native_red   >> 2));
+			green = ((native_green << 3) | (native_green >> 2));
+			blue  = ((native_blue  << 3) | (native_blue  >> 2));
+			break;
+		case(COLOR_LCD_BRIGHT):
+			red   = ((native_red * 13) + (native_green * 2) + native_blue) >> 1;
+			green = ((native_green * 3) + native_blue) << 1;
+			blue  = ((native_red * 3) + (native_green * 2) + (native_blue * 11)) >> 1;
+			break;
+		default: //COLOR_LCD
+			red   = ((native_red * 26) + (native_green * 4) + (native_blue * 2));
+			green = ((native_green * 24) + (native_blue * 8));
+			blue  = ((native_red * 6) + (native_green * 4) + (native_blue * 22));
+			red   = std::min((uint16_t)960, red) >> 2;
+			green = std::min((uint16_t)960, green) >> 2;
+			blue  = std::min((uint16_t)960, blue) >> 2;
+			break;
+		}
 
-	uncorr_red   = ((native_red   << 3) | (native_red   >> 2));
-	uncorr_green = ((native_green << 3) | (native_green >> 2));
-	uncorr_blue  = ((native_blue  << 3) | (native_blue  >> 2));
+		colorLUT[nativeColor] = ((red & 0xFF) << 24) | ((green & 0xFF) << 16) | ((blue & 0xFF) << 8) | 0x000000FF;
+	}
 
-	temp_red = ((native_red * 26) + (native_green * 4) + (native_blue * 2));
-	temp_green = ((native_green * 24) + (native_blue * 8));
-	temp_blue = ((native_red * 6) + (native_green * 4) + (native_blue * 22));
-	temp_red = std::min((uint16_t)960, temp_red) >> 2;
-	temp_green = std::min((uint16_t)960, temp_green) >> 2;
-	temp_blue = std::min((uint16_t)960, temp_blue) >> 2;
+	for (uint8_t index = 0; index < 64; index += 2)
+	{
+		UpdatePaletteColor(false, index);
+		UpdatePaletteColor(true, index);
+	}
+}
 
-	finalColor |= (temp_red & 0xFF) << 24;
-	finalColor |= (temp_green & 0xFF) << 16;
-	finalColor |= (temp_blue & 0xFF) << 8;
+Mmu::COLOR_CORRECTION Mmu::GetColorCorrection()
+{
+	return colorCorrection;
+}
 
-	return finalColor;
+//index is the BGPI/OBPI byte index of either half of the colour
+void Mmu::UpdatePaletteColor(bool sprite, uint8_t index)
+{
+	std::array<uint8_t, 64>& palette = sprite ? cgb_OBP : cgb_BGP;
+	index &= 0x3E;
+	uint16_t nativeColor = (palette[index + 1] << 8) | palette[index];
+	cgbColors[(sprite ? 32 : 0) + (index >> 1)] = colorLUT[nativeColor & 0x7FFF];
 }
 
 bool Mmu::isBootRomEnabled()
@@ -993,6 +668,8 @@ void Mmu::DoHDMATransfer()
 		{
 			VRAM[currentVRAMBank][HDMADestAddr + HDMATransferredTotal + i] = ReadByteDirect(HDMASrcAddr + HDMATransferredTotal + i);
 		}
+		tileCache.InvalidateRange(currentVRAMBank, HDMADestAddr + HDMATransferredTotal, 16);
+		JournalVRAM(currentVRAMBank, HDMADestAddr + HDMATransferredTotal, 16);
 		HDMATransferredTotal += 16;
 		bytesLeft -= 16;
 		if (bytesLeft == 0)
@@ -1006,7 +683,23 @@ void Mmu::DoHDMATransfer()
 //bypass safety and write directly to address in memory
 void Mmu::WriteByteDirect(uint16_t addr, uint8_t val)
 {
+	if (addr >= 0xFF04 && addr <= 0xFF07) //the timer keeps its own registers
+	{
+		Timer::WriteRegister(&timer, addr, val);
+		return;
+	}
 	Memory[addr] = val;
+
+	if (addr >= 0xFE00 && addr <= 0xFE9F)
+		oamChanged = true;
+
+	if (addr == 0xFF0F || addr == 0xFFFF)
+		UpdatePendingInterrupts();
+}
+
+void Mmu::UpdatePendingInterrupts()
+{
+	pendingInterrupts = Memory[0xFFFF] & Memory[0xFF0F] & 0x1F;
 }
 
 void Mmu::ParseRomHeader(const std::string& romFileName)
@@ -1068,6 +761,25 @@ void Mmu::ParseRomHeader(const std::string& romFileName)
 		break;
 	}
 
+	switch (currentMBC)
+	{
+	case(MBC_TYPE::MBC1):
+		UseMBC<MBC_TYPE::MBC1>();
+		break;
+	case(MBC_TYPE::MBC2):
+		UseMBC<MBC_TYPE::MBC2>();
+		break;
+	case(MBC_TYPE::MBC3):
+		UseMBC<MBC_TYPE::MBC3>();
+		break;
+	case(MBC_TYPE::MBC5):
+		UseMBC<MBC_TYPE::MBC5>();
+		break;
+	default:
+		UseMBC<MBC_TYPE::NOMBC>();
+		break;
+	}
+
 	switch (rom_size)
 	{
 	case(0x01):
@@ -1100,6 +812,9 @@ void Mmu::ParseRomHeader(const std::string& romFileName)
 		break;
 	}
 
+	if (romSize < (size_t)totalRomBanks * 0x4000) //the file is shorter than the header says
+		PadRom((size_t)totalRomBanks * 0x4000);
+
 	switch (ram_size)
 	{
 	case(0x02):
@@ -1138,6 +853,7 @@ void Mmu::ParseRomHeader(const std::string& romFileName)
 		}
 	}
 
+	UpdatePageTable();
 	return;
 }
 
@@ -1330,6 +1046,116 @@ void Mmu::SaveGame(const std::string& romFileName)
 	return;
 }
 
+template<Mmu::MBC_TYPE mbc>
+void Mmu::UseMBC()
+{
+	writeMBC = &Mmu::WriteMBC<mbc>;
+	readCartArea = &Mmu::ReadCartArea<mbc>;
+	writeCartArea = &Mmu::WriteCartArea<mbc>;
+	getCartRamOffset = &Mmu::GetCartRamOffset<mbc>;
+}
+
+template<Mmu::MBC_TYPE mbc>
+void Mmu::WriteMBC(uint16_t addr, uint8_t val)
+{
+	if constexpr (mbc == MBC1) WriteMBC1(addr, val);
+	else if constexpr (mbc == MBC2) WriteMBC2(addr, val);
+	else if constexpr (mbc == MBC3) WriteMBC3(addr, val);
+	else if constexpr (mbc == MBC5) WriteMBC5(addr, val);
+	else
+	{
+		//std::cout << "Blocked write to 0x" << std::hex << std::setfill('0') << std::uppercase << std::setw(4) << addr << std::endl;
+		return;
+	}
+	UpdatePageTable();
+}
+
+//Where addr lands in CartRam. Returns false if it isn't backed by cart ram at the moment
+//(ram disabled or missing, or an rtc register selected)
+template<Mmu::MBC_TYPE mbc>
+bool Mmu::GetCartRamOffset(uint16_t addr, uint16_t& offset)
+{
+	if constexpr (mbc == MBC3)
+	{
+		if (doesRTCExist && isRTCEnabled && (mappedRTCReg < RTCREGS::NONE))
+			return false;
+	}
+	if (!isCartRamEnabled || !totalRamBanks)
+		return false;
+
+	if constexpr (mbc == MBC1)
+		offset = (totalRamBanks > 1 && mbc1Mode == 1) ? (uint16_t)(((uint32_t)hiBank << 13) + (addr & 0x1FFF)) : (addr & 0x1FFF);
+	else if constexpr (mbc == MBC2)
+		offset = addr & 0x01FF;
+	else if constexpr (mbc == MBC3)
+		offset = (totalRamBanks > 1) ? (uint16_t)(((uint32_t)hiBank << 13) + (addr & 0x1FFF)) : (addr & 0x1FFF);
+	else if constexpr (mbc == MBC5)
+		offset = (totalRamBanks > 1) ? (uint16_t)(((uint32_t)currentRamBank << 13) + (addr & 0x1FFF)) : (addr & 0x1FFF);
+	else
+		return false;
+	return true;
+}
+
+template<Mmu::MBC_TYPE mbc>
+uint8_t Mmu::ReadCartArea(uint16_t addr)
+{
+	if constexpr (mbc == MBC3)
+	{
+		if (doesRTCExist && isRTCEnabled && (mappedRTCReg < RTCREGS::NONE))
+		{
+			if (isRTCLatched)
+			{
+				return latchedRtcRegValues[mappedRTCReg];
+			}
+			else
+			{
+				return rtcRegValues[mappedRTCReg];
+			}
+		}
+	}
+	uint16_t offset;
+	if (!GetCartRamOffset<mbc>(addr, offset))
+		return 0xFF;
+	return ReadCartRam(offset);
+}
+
+template<Mmu::MBC_TYPE mbc>
+void Mmu::WriteCartArea(uint16_t addr, uint8_t val)
+{
+	if constexpr (mbc == MBC3)
+	{
+		if (doesRTCExist && isRTCEnabled && (mappedRTCReg < RTCREGS::NONE))
+		{
+			switch (mappedRTCReg)
+			{
+			case(RTCREGS::S):
+				rtc_ticks = 0;
+			case(RTCREGS::M):
+				rtcRegValues[mappedRTCReg] = val & 0x3F;
+				break;
+			case(RTCREGS::H):
+				rtcRegValues[mappedRTCReg] = val & 0x1F;
+				break;
+			case(RTCREGS::DL):
+				rtcRegValues[mappedRTCReg] = val;
+				break;
+			case(RTCREGS::DH):
+				rtcRegValues[mappedRTCReg] = val & 0xC1;
+				break;
+			default:
+				break;
+			}
+			return;
+		}
+	}
+	uint16_t offset;
+	if (!GetCartRamOffset<mbc>(addr, offset))
+		return;
+	if constexpr (mbc == MBC2)
+		val = (val & 0x0F) | 0xF0; //only the low nibble exists
+	WriteCartRam(offset, val);
+}
+
 uint8_t Mmu::ReadCartRam(uint16_t addr)
 {
 	if (CartRam.size() >= addr + 1)
@@ -1343,6 +1169,7 @@ void Mmu::WriteCartRam(uint16_t addr, uint8_t val)
 	if (CartRam.size() >= addr + 1)
 	{
 		CartRam[addr] = val;
+		CheckCodeWrite(CODEKEY_CARTRAM + addr);
 		return;
 	}
 
@@ -1353,6 +1180,295 @@ void Mmu::WriteCartRam(uint16_t addr, uint8_t val)
 void Mmu::RegisterApu(Apu* which)
 {
 	apu = which;
+	for (uint16_t addr = 0xFF10; addr < 0xFF40; addr++)
+	{
+		if (apu)
+			RegisterIoHandler(addr, &Apu::ReadRegister, &Apu::WriteRegister, apu);
+		else
+			RegisterIoHandler(addr, &Mmu::ReadIoMemory, &Mmu::WriteSoundNoApu, this);
+	}
+}
+
+void Mmu::RegisterIoHandler(uint16_t addr, IoReadHandler read, IoWriteHandler write, void* user)
+{
+	ioHandlers[addr & 0x7F] = { read, write, user };
+}
+
+void Mmu::RegisterScheduler(Scheduler* which)
+{
+	scheduler = which;
+}
+
+uint64_t Mmu::CyclesUntilNextEvent()
+{
+	//OAM DMA changes what the cpu reads on every access, the link cable is polled from another thread, and rumble
+	//strength is read by main at the end of the frame. All of those need ticking after every instruction
+	if (DMAInProgress || linkCable || rumbleActive)
+		return 0;
+	//the rtc only counts, it's caught up whenever the game touches it
+	return UINT64_MAX;
+}
+
+//Addresses whose contents depend on how far the ppu, mmu and timers have run: the io registers other than sound,
+//IE, and with an rtc the mbc registers and cart ram it's mapped over
+bool Mmu::IsTimedAddress(uint16_t addr)
+{
+	if (addr >= 0xFF00)
+		return (addr < 0xFF10 || (addr > 0xFF3F && addr < 0xFF80) || addr == 0xFFFF);
+	if (doesRTCExist)
+		return (addr < 0x8000 || (addr > 0x9FFF && addr < 0xC000));
+	return false;
+}
+
+//Bits that always read back as 1 for each io register, either unused or write only
+const std::array<uint8_t, 0x80> Mmu::IoReadMask = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, //FF00
+	0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF, 0x7F, 0xFF, 0x9F, 0xFF, 0xBF, 0xFF, //FF10
+	0xFF, 0x00, 0x00, 0xBF, 0x00, 0x00, 0x70, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, //FF20
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, //FF30
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, //FF40
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, //FF50
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, //FF60
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, //FF70
+};
+
+//plain registers, just kept in the mapped memory
+uint8_t Mmu::ReadIoMemory(void* mmu, uint16_t addr)
+{
+	return ((Mmu*)mmu)->Memory[addr];
+}
+
+void Mmu::WriteIoMemory(void* mmu, uint16_t addr, uint8_t val)
+{
+	((Mmu*)mmu)->Memory[addr] = val;
+}
+
+void Mmu::WriteIoReadOnly(void* mmu, uint16_t addr, uint8_t val)
+{
+}
+
+uint8_t Mmu::ReadJoypad(void* mmu, uint16_t addr)
+{
+	Mmu* m = (Mmu*)mmu;
+	uint8_t value = m->Memory[0xFF00];
+
+	if (!(value & 0x20)) //buttons selected
+	{
+		value &= 0xF0 | m->Joypad.buttons;
+	}
+	else if (!(value & 0x10)) //directions selected
+	{
+		value &= 0xF0 | m->Joypad.directions;
+	}
+
+	return value;
+}
+
+void Mmu::WriteJoypad(void* mmu, uint16_t addr, uint8_t val)
+{
+	Mmu* m = (Mmu*)mmu;
+	uint8_t joypadSelect = val & 0x30; //get only the 2 bits for mode select
+	m->Memory[0xFF00] &= 0xCF; // clear the 2 select bits. 0xFF00 & 1100 1111
+	m->Memory[0xFF00] |= joypadSelect; //set the new joypad mode
+}
+
+void Mmu::WriteSerial(void* mmu, uint16_t addr, uint8_t val)
+{
+	Mmu* m = (Mmu*)mmu;
+	Serial* linkCable = m->linkCable;
+	if (addr == 0xFF01)
+	{
+		//std::cout << (char)val << std::flush;
+		m->Memory[addr] = val;
+		if (linkCable)
+			linkCable->SB = val;
+		return;
+	}
+
+	if ((val & 0x81) == 0x81)
+	{
+		if (linkCable)
+		{
+			if (linkCable->IsConnected())
+			{
+				if (!linkCable->expectingResponse)
+				{
+					linkCable->expectingResponse = true;
+					linkCable->outgoingQueue.push(linkCable->SB);
+				}
+			}
+			else
+			{
+				linkCable->incomingQueue.push(0xFF);
+			}
+		}
+		else
+		{
+			//std::cout << (char)Memory[0xFF01] << std::flush;
+			m->Memory[0xFF01] = 0xFF;
+		}
+	}
+	m->Memory[addr] = m->cgbSupport ? (val | 0x7C) : (val | 0x7E);
+}
+
+void Mmu::WriteIF(void* mmu, uint16_t addr, uint8_t val)
+{
+	Mmu* m = (Mmu*)mmu;
+	m->Memory[0xFF0F] = val;
+	m->UpdatePendingInterrupts();
+}
+
+//sound registers when there's no apu. Only the power bit of NR52 and wave ram stick
+void Mmu::WriteSoundNoApu(void* mmu, uint16_t addr, uint8_t val)
+{
+	Mmu* m = (Mmu*)mmu;
+	if (addr == 0xFF26)
+	{
+		if (val & 0x80)
+			m->Memory[0xFF26] |= 0x80;
+		else
+			m->Memory[0xFF26] = 0x00;
+		return;
+	}
+	if (addr >= 0xFF30)
+		m->Memory[addr] = val;
+}
+
+void Mmu::WriteSTAT(void* mmu, uint16_t addr, uint8_t val)
+{
+	Mmu* m = (Mmu*)mmu;
+	m->Memory[0xFF41] = (val & 0xF8) | (m->Memory[0xFF41] & 0x07); //mask off the bottom 3 bits which are read only
+}
+
+void Mmu::WriteDMA(void* mmu, uint16_t addr, uint8_t val)
+{
+	Mmu* m = (Mmu*)mmu;
+	m->Memory[0xFF46] = val;
+	m->DMABaseAddr = val << 8;
+	m->DMACycles = 0;
+	m->DMAInProgress = true;
+}
+
+void Mmu::WriteKEY1(void* mmu, uint16_t addr, uint8_t val) //prep speed switch. cgb only
+{
+	Mmu* m = (Mmu*)mmu;
+	m->Memory[0xFF4D] &= 0x80;
+	m->Memory[0xFF4D] |= 0x7E;
+	m->Memory[0xFF4D] |= (val & 0x01);
+}
+
+void Mmu::WriteVBK(void* mmu, uint16_t addr, uint8_t val)
+{
+	Mmu* m = (Mmu*)mmu;
+	m->currentVRAMBank = val & 0x01;
+	m->Memory[0xFF4F] = 0xFE | m->currentVRAMBank;
+	m->UpdatePageTable();
+}
+
+void Mmu::WriteBootRomDisable(void* mmu, uint16_t addr, uint8_t val) //Zero on startup. Non-zero disables bootrom
+{
+	Mmu* m = (Mmu*)mmu;
+	if (m->bootRomEnabled && (val & 0x01))
+	{
+		m->bootRomEnabled = false;
+		m->Memory[0xFF50] = 0xFF;
+		m->mapGeneration++;
+		m->UpdatePageTable();
+
+		//if (cgbMode && (!cgbSupport))
+		//{
+		//	cgbMode = false;
+		//}
+	}
+}
+
+void Mmu::WriteHDMA(void* mmu, uint16_t addr, uint8_t val)
+{
+	Mmu* m = (Mmu*)mmu;
+	uint8_t* Memory = m->Memory;
+	switch (addr)
+	{
+	case(0xFF51): //HDMA1 Src Addr High Byte
+		Memory[0xFF51] = val;
+		return;
+	case(0xFF52): //HDMA2 Src Addr Low Byte
+		Memory[0xFF52] = val & 0xF0;
+		return;
+	case(0xFF53): //HDMA3 Dest High Byte
+		Memory[0xFF53] = val & 0x1F;
+		return;
+	case(0xFF54): //HDMA4 Dest Low Byte
+		Memory[0xFF54] = val & 0xF0;
+		return;
+	default: //HDMA5 start/stop/length
+		break;
+	}
+
+	//Memory[0xFF55] = val;
+	if (val & 0x80) //start h-blank dma
+	{
+		m->HDMAInProgress = true;
+		m->HDMATransferredTotal = 0;
+		m->HDMATransferredThisLine = 0;
+		m->HDMALength = ((val & 0x7F) + 1) << 4;
+		m->HDMASrcAddr = ((uint16_t)Memory[0xFF51] << 8) | Memory[0xFF52];
+		m->HDMADestAddr = (((uint16_t)Memory[0xFF53] << 8) | Memory[0xFF54]) & 0x1FFF;
+		Memory[0xFF55] = val & 0x7F;
+	}
+	else if (m->HDMAInProgress) //stop h-blank dma
+	{
+		m->HDMAInProgress = false;
+		Memory[0xFF55] |= 0x80;
+	}
+	else //perform general dma
+	{
+		uint16_t src = ((uint16_t)Memory[0xFF51] << 8) | Memory[0xFF52];
+		uint16_t dest = (((uint16_t)Memory[0xFF53] << 8) | Memory[0xFF54]) & 0x1FFF;
+
+		uint16_t length = ((val & 0x7F) + 1) << 4;
+
+		for (uint16_t i = 0; i < length; i++)
+		{
+			m->VRAM[m->currentVRAMBank][dest + i] = m->ReadByteDirect(src + i);
+		}
+		m->tileCache.InvalidateRange(m->currentVRAMBank, dest, length);
+		m->JournalVRAM(m->currentVRAMBank, dest, length);
+		Memory[0xFF55] = 0xFF;
+	}
+}
+
+//CGB BGPD and OBPD, read and written through the index in BGPI/OBPI
+uint8_t Mmu::ReadPaletteData(void* mmu, uint16_t addr)
+{
+	Mmu* m = (Mmu*)mmu;
+	if (addr == 0xFF69)
+		return m->cgb_BGP[m->Memory[0xFF68] & 0x3F];
+	return m->cgb_OBP[m->Memory[0xFF6A] & 0x3F];
+}
+
+void Mmu::WritePaletteData(void* mmu, uint16_t addr, uint8_t val)
+{
+	Mmu* m = (Mmu*)mmu;
+	uint8_t& index = m->Memory[addr - 1];
+	std::array<uint8_t, 64>& palette = (addr == 0xFF69) ? m->cgb_BGP : m->cgb_OBP;
+	palette[index & 0x3F] = val;
+	m->UpdatePaletteColor(addr == 0xFF6B, index);
+	if (index & 0x80)
+	{
+		index = (((index & 0x3F) + 1) & 0x3F) | 0x80; //increment palette index
+	}
+}
+
+void Mmu::WriteSVBK(void* mmu, uint16_t addr, uint8_t val) //wram bank (cgb only)
+{
+	Mmu* m = (Mmu*)mmu;
+	m->currentWRAMBank = val & 0x07;
+	if (m->currentWRAMBank == 0)
+		m->currentWRAMBank = 1;
+
+	m->Memory[0xFF70] = 0xF8 | m->currentWRAMBank;
+	m->mapGeneration++;
+	m->UpdatePageTable();
 }
 
 void Mmu::WriteMBC1(uint16_t addr, uint8_t val)
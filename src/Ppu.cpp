@@ -4,6 +4,7 @@
 Ppu::Ppu(Mmu* __mmu, SDL_Texture* tex, SDL_Renderer* rend) : mmu(__mmu), ppuTexture(tex), ppuRenderer(rend)
 {
 	memcpy(palette, palette_dmg_green, sizeof(palette));
+	UpdatePairColors();
 	//SDL_RenderClear(ppuRenderer);
 	//SDL_RenderPresent(ppuRenderer);
 	//SDL_SetTextureBlendMode(ppuTexture, SDL_BLENDMODE_BLEND);
@@ -13,10 +14,43 @@ Ppu::Ppu(Mmu* __mmu, SDL_Texture* tex, SDL_Renderer* rend) : mmu(__mmu), ppuText
 	{
 		WorkingColorFrameBuffer[i] = wipeColor;
 		ColorFrameBuffer[i] = wipeColor;
-		PrevColorFrameBuffer[i] = wipeColor;
 	}
 	memset(FrameBuffer, 0x03, sizeof(FrameBuffer));
+
+	drawVRAM = &mmu->GetVRAM();
+	drawTiles = &mmu->tileCache;
+	if (renderMode != RENDER_HBLANK)
+	{
+		logVRAM = mmu->GetVRAM();
+		mmu->SetVRAMJournal(&vramJournal);
+		drawVRAM = &logVRAM;
+		drawTiles = &logTiles;
+	}
+	if (renderMode == RENDER_WORKER)
+	{
+		renderThread = SDL_CreateThread(RenderThread, "kgb ppu", this);
+		if (!renderThread)
+		{
+			std::cout << "WARNING: Could not start the PPU render thread: " << SDL_GetError() << std::endl;
+			std::cout << "Drawing the frame at vblank instead." << std::endl;
+			renderMode = RENDER_VBLANK;
+		}
+	}
+
 	ppuBlendTexture = SDL_CreateTexture(ppuRenderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 160, 144);
+
+	int access = SDL_TEXTUREACCESS_TARGET;
+	if (ppuTexture && SDL_QueryTexture(ppuTexture, nullptr, &access, nullptr, nullptr) == 0)
+		streamingTexture = (access == SDL_TEXTUREACCESS_STREAMING);
+}
+
+Ppu::~Ppu()
+{
+	if (renderThread)
+	{
+		stopWorker = true;
+		SDL_WaitThread(renderThread, nullptr);
+	}
 }
 
 
@@ -32,12 +66,12 @@ void Ppu::Tick(uint16_t cycles)
 		if (isLCDOn)
 		{
 			isLCDOn = false;
+			FinishLines(); //they get wiped straight away, but the window line counter has to move on all the same
 			static const unsigned wipeColor = mmu->GetCGBMode() ? 0xFFFFFFFF : 0x909b43FF;
 			for (int i = 0; i < 160 * 144; i++)
 			{
 				WorkingColorFrameBuffer[i] = wipeColor;
 				ColorFrameBuffer[i] = wipeColor;
-				PrevColorFrameBuffer[i] = wipeColor;
 			}
 			memset(WorkingFrameBuffer, 0x00, sizeof(WorkingFrameBuffer));
 			memset(FrameBuffer, 0x00, sizeof(FrameBuffer));
@@ -126,6 +160,35 @@ void Ppu::Tick(uint16_t cycles)
 	return;
 }
 
+uint64_t Ppu::CyclesUntilNextEvent()
+{
+	uint8_t lcdc = mmu->ReadByteDirect(0xFF40);
+
+	if (!(lcdc & LCD_ENABLE))
+	{
+		if (isLCDOn || currentLine != 0 || currentMode != 0)
+			return 0; //still has to wipe the screen and reset
+		return UINT64_MAX;
+	}
+	if (!isLCDOn)
+		return 0;
+
+	//the PpuCycles each mode's transition in Tick fires at
+	uint64_t target;
+	switch (currentMode)
+	{
+	case(0): target = 456; break;
+	case(1): target = (currentLine == 153 && !lastLineBugTriggered) ? 4 : 456; break;
+	case(2): target = OAM_CYCLES + 1; break;
+	case(3): target = OAM_CYCLES + DRAW_CYCLES + 1; break;
+	default: return 0;
+	}
+
+	if (PpuCycles >= target)
+		return 0;
+	return (target - PpuCycles) * mmu->DMASpeed;
+}
+
 bool Ppu::StatIntAvail()
 {
 	uint8_t stat = mmu->ReadByteDirect(0xFF41);
@@ -187,6 +250,8 @@ void Ppu::SetMode(uint8_t mode)
 	}
 	case(1): //enter vblank
 	{
+		FinishLines();
+
 		//copy working buffer to the public buffer upon entering vblank
 		RenderFrame();
 
@@ -293,208 +358,283 @@ uint32_t* Ppu::GetColorFrameBuffer()
 	return ColorFrameBuffer;
 }
 
+void Ppu::SetFrameExchange(FrameExchange* exchange)
+{
+	frameExchange = exchange;
+	refreshFrame = true;
+}
+
+void Ppu::SetFrameBlending(bool enable)
+{
+	blendFrames = enable;
+	UpdatePairColors();
+	refreshFrame = true;
+}
+
+bool Ppu::GetFrameBlending()
+{
+	return blendFrames;
+}
+
+//Take everything the line needs from the registers and sprite search
+void Ppu::CaptureLine(LineState& state)
+{
+	state.line = currentLine;
+	state.lcdc = mmu->ReadByteDirect(0xFF40);
+	state.scy = mmu->ReadByteDirect(0xFF42);
+	state.scx = mmu->ReadByteDirect(0xFF43);
+	state.bgp = mmu->ReadByteDirect(0xFF47);
+	state.obp0 = mmu->ReadByteDirect(0xFF48);
+	state.obp1 = mmu->ReadByteDirect(0xFF49);
+	state.wy = mmu->ReadByteDirect(0xFF4A);
+	state.wx = mmu->ReadByteDirect(0xFF4B);
+	state.windowLYTrigger = windowLYTrigger;
+	state.cgbMode = mmu->GetCGBMode();
+	state.dmgPalettes = !(mmu->GetCGBSupport() || mmu->isBootRomEnabled());
+	state.vramBank = mmu->GetVRAMBank();
+	state.spriteCount = lineSpriteCount;
+	state.sprites = lineSprites;
+	if (state.cgbMode)
+		memcpy(state.colors, mmu->GetPaletteColors(), sizeof(state.colors));
+}
+
 void Ppu::RenderLine()
 {
-	if (mmu->GetCGBMode())
-		RenderLineCGB();
+	switch (renderMode)
+	{
+	case(RENDER_VBLANK):
+	{
+		lineLog.emplace_back();
+		CaptureLine(lineLog.back());
+		lineLog.back().journalPosition = vramJournal.size();
+		break;
+	}
+	case(RENDER_WORKER):
+	{
+		SendJournal();
+		LineState* state;
+		while (!(state = lineQueue.BeginPush())) //the render thread is a whole queue behind, let it catch up
+			SDL_Delay(0);
+		CaptureLine(*state);
+		state->journalPosition = journalSent;
+		lineQueue.EndPush();
+		break;
+	}
+	default:
+		CaptureLine(lineState);
+		DrawLine(lineState);
+		break;
+	}
+}
+
+void Ppu::DrawLine(const LineState& state)
+{
+	if (state.cgbMode)
+		RenderLineCGB(state);
 	else
-		RenderLineDMG();
+		RenderLineDMG(state);
 }
 
-void Ppu::RenderLineCGB()
+//Draw the lines logged since the last call, in order. Before each one the ppu's copy of VRAM catches up with the
+//journal as far as it had got when the line was logged, so mid frame VRAM writes land between the same lines they did
+void Ppu::DrawLoggedLines()
 {
-	uint8_t lcdc = mmu->ReadByteDirect(0xFF40);
-	uint8_t scy = mmu->ReadByteDirect(0xFF42);
-	uint8_t scx = mmu->ReadByteDirect(0xFF43);
+	for (const LineState& state : lineLog)
+	{
+		ReplayJournal(state.journalPosition);
+		DrawLine(state);
+	}
+	ReplayJournal(vramJournal.size());
+
+	lineLog.clear();
+	vramJournal.clear();
+	journalReplayed = 0;
+}
+
+void Ppu::ReplayJournal(size_t end)
+{
+	for (; journalReplayed < end; journalReplayed++)
+		ApplyJournalEntry(vramJournal[journalReplayed]);
+}
+
+void Ppu::ApplyJournalEntry(uint32_t entry)
+{
+	uint8_t bank = entry >> 21;
+	uint16_t offset = (entry >> 8) & 0x1FFF;
+	logVRAM[bank][offset] = entry & 0xFF;
+	logTiles.Invalidate(bank, offset);
+}
+
+//Make sure every line captured so far is in the working frame buffers
+void Ppu::FinishLines()
+{
+	switch (renderMode)
+	{
+	case(RENDER_VBLANK):
+		DrawLoggedLines();
+		break;
+	case(RENDER_WORKER):
+		while (!lineQueue.Empty()) //lines only leave the queue once they're drawn
+			SDL_Delay(0);
+		break;
+	default:
+		break;
+	}
+}
+
+//worker mode: pass the VRAM writes made since the last call on to the render thread
+void Ppu::SendJournal()
+{
+	for (uint32_t entry : vramJournal)
+	{
+		while (!journalQueue.Push(entry))
+			SDL_Delay(0);
+		journalSent++;
+	}
+	vramJournal.clear();
+}
+
+int Ppu::RenderThread(void* ppu)
+{
+	((Ppu*)ppu)->RenderWorker();
+	return 0;
+}
+
+//The render thread. Works through the lines the same way DrawLoggedLines does, catching its copy of VRAM up with the
+//journal before each one. With no lines waiting it applies whatever writes have already arrived as well, they can only
+//belong before lines that haven't been sent yet, and otherwise a full journal queue would never drain
+void Ppu::RenderWorker()
+{
+	int idleLoops = 0;
+	while (!stopWorker)
+	{
+		uint64_t journalAvailable = journalApplied + journalQueue.Count(); //has to be read before looking for a line
+		LineState* state = lineQueue.Front();
+		uint64_t journalEnd = state ? state->journalPosition : journalAvailable;
+		for (; journalApplied < journalEnd; journalApplied++)
+		{
+			ApplyJournalEntry(*journalQueue.Front());
+			journalQueue.Pop();
+		}
+
+		if (state)
+		{
+			DrawLine(*state);
+			lineQueue.Pop();
+			idleLoops = 0;
+		}
+		else if (++idleLoops < 1000)
+			SDL_Delay(0);
+		else
+			SDL_Delay(1); //nothing for a while, probably paused or the lcd is off
+	}
+}
+
+//Draw one line of the background or window from screen pixel startX to the right edge. mapRowAddr is the start of the
+//tile map row to draw from and mapX the pixel within that row to start at, wrapping around at the end of the row.
+//Goes a tile at a time: one map lookup per tile and a copy out of the tile cache, the first tile may start part way in
+void Ppu::RenderTilesDMG(const LineState& state, uint16_t mapRowAddr, uint16_t dataBaseAddr, uint8_t tileY, uint8_t mapX, int startX, const uint8_t bgp[4])
+{
+	uint8_t vramBank = state.vramBank; //no vram banking on dmg, but the register still works in this mode
+	const std::array<uint8_t, 0x2000>& vram = (*drawVRAM)[vramBank];
+	uint8_t* line = &WorkingFrameBuffer[state.line * 160];
+	uint8_t tileX = mapX & 0x07;
+	uint8_t tileMapX = mapX >> 3;
+
+	for (int screenX = startX; screenX < 160; tileMapX = (tileMapX + 1) & 0x1F)
+	{
+		uint8_t mapData = vram[(mapRowAddr + tileMapX) & 0x1FFF];
+		uint16_t tile = (dataBaseAddr == 0x8000) ? mapData : 256 + (int8_t)mapData;
+		const uint8_t* tileRow = drawTiles->GetRow(vramBank, tile, tileY, false);
+
+		int count = std::min(8 - tileX, 160 - screenX);
+		for (int i = 0; i < count; i++)
+			line[screenX + i] = bgp[tileRow[tileX + i]];
+		screenX += count;
+		tileX = 0;
+	}
+}
+
+//cgb tiles go into bgLine with their palette and priority, they get their colours once the sprites are merged in
+void Ppu::RenderTilesCGB(uint16_t mapRowAddr, uint16_t dataBaseAddr, uint8_t tileY, uint8_t mapX, int startX)
+{
+	const std::array<std::array<uint8_t, 0x2000>, 2>& vram = *drawVRAM;
+	uint8_t tileX = mapX & 0x07;
+	uint8_t tileMapX = mapX >> 3;
+
+	for (int screenX = startX; screenX < 160; tileMapX = (tileMapX + 1) & 0x1F)
+	{
+		uint8_t mapData = vram[0][(mapRowAddr + tileMapX) & 0x1FFF];
+		uint8_t attrMapData = vram[1][(mapRowAddr + tileMapX) & 0x1FFF];
+		uint8_t paletteBits = (attrMapData & 0x07) << 2;
+		uint8_t tileVRAMBank = (attrMapData & 0x08) >> 3;
+		bool xFlip = (attrMapData & 0x20) >> 5;
+		bool yFlip = (attrMapData & 0x40) >> 6;
+		uint8_t priorityBit = (attrMapData & 0x80) ? Compositor::BG_PRIORITY : 0;
+
+		uint16_t tile = (dataBaseAddr == 0x8000) ? mapData : 256 + (int8_t)mapData;
+		const uint8_t* tileRow = drawTiles->GetRow(tileVRAMBank, tile, yFlip ? 7 - tileY : tileY, xFlip);
+
+		int count = std::min(8 - tileX, 160 - screenX);
+		for (int i = 0; i < count; i++)
+			bgLine[screenX + i] = priorityBit | paletteBits | tileRow[tileX + i];
+		screenX += count;
+		tileX = 0;
+	}
+}
+
+void Ppu::RenderLineCGB(const LineState& state)
+{
+	uint8_t lcdc = state.lcdc;
+	uint8_t scy = state.scy;
+	uint8_t scx = state.scx;
 
 	uint8_t bgp[4] = { 0 };
-	bgp[0] = mmu->ReadByteDirect(0xFF47) & 0x03;
-	bgp[1] = (mmu->ReadByteDirect(0xFF47) >> 2) & 0x03;
-	bgp[2] = (mmu->ReadByteDirect(0xFF47) >> 4) & 0x03;
-	bgp[3] = (mmu->ReadByteDirect(0xFF47) >> 6) & 0x03;
+	bgp[0] = state.bgp & 0x03;
+	bgp[1] = (state.bgp >> 2) & 0x03;
+	bgp[2] = (state.bgp >> 4) & 0x03;
+	bgp[3] = (state.bgp >> 6) & 0x03;
 
 	//render background
 	if (lcdc)
 	{
 		uint16_t bgMapBaseAddr = (lcdc & 0x08) ? 0x9C00 : 0x9800;
 		uint16_t bgDataBaseAddr = (lcdc & 0x10) ? 0x8000 : 0x9000;
-		uint8_t u_bgDataIndex = 0;
-		int8_t s_bgDataIndex = 0;
 
-		uint8_t bgMapY = ((scy + currentLine) % 256) >> 3; // Background Map Tile Y
-		uint8_t tileY = ((scy + currentLine) % 256) & 0x07; // the number of lines from the top of the tile
+		uint8_t bgMapY = ((scy + state.line) % 256) >> 3; // Background Map Tile Y
+		uint8_t tileY = ((scy + state.line) % 256) & 0x07; // the number of lines from the top of the tile
 
-		for (int screenX = 0; screenX < 160; screenX++)
-		{
-			uint8_t bgMapX = ((scx + screenX) % 256) >> 3; // Background Map Tile X
-			uint8_t tileX = ((scx + screenX) % 256) & 0x07; // number of pixels from left to right on the tile
-			uint8_t tileDataH, tileDataL;
-			uint8_t bgColorIndex = 0;
-			uint8_t bgPaletteNum = 0;
-			uint8_t bgTileVRAMBank = 0;
-
-			bool bgXFlip = 0;
-			bool bgYFlip = 0;
-			bool bgTilePriorityBit = 0;
-
-			if (bgDataBaseAddr == 0x8000)
-			{
-				u_bgDataIndex = mmu->ReadVRAMDirect(bgMapBaseAddr + (bgMapY * 32) + bgMapX, 0);
-				uint8_t bgAttrMapData = mmu->ReadVRAMDirect(bgMapBaseAddr + (bgMapY * 32) + bgMapX, 1);
-				bgPaletteNum = bgAttrMapData & 0x07;
-				bgTileVRAMBank = (bgAttrMapData & 0x08) >> 3;
-				
-				bgXFlip = (bgAttrMapData & 0x20) >> 5;
-				bgYFlip = (bgAttrMapData & 0x40) >> 6;
-				bgTilePriorityBit = (bgAttrMapData & 0x80) >> 7;
-
-				if (bgYFlip)
-				{
-					tileDataL = mmu->ReadVRAMDirect(bgDataBaseAddr + (u_bgDataIndex * 16) + ((7 - tileY) * 2), bgTileVRAMBank);
-					tileDataH = mmu->ReadVRAMDirect(bgDataBaseAddr + (u_bgDataIndex * 16) + ((7 - tileY) * 2) + 1, bgTileVRAMBank);
-				}
-				else
-				{
-					tileDataL = mmu->ReadVRAMDirect(bgDataBaseAddr + (u_bgDataIndex * 16) + (tileY * 2), bgTileVRAMBank);
-					tileDataH = mmu->ReadVRAMDirect(bgDataBaseAddr + (u_bgDataIndex * 16) + (tileY * 2) + 1, bgTileVRAMBank);
-				}
-			}
-			else
-			{
-				s_bgDataIndex = mmu->ReadVRAMDirect(bgMapBaseAddr + (bgMapY * 32) + bgMapX, 0);
-				uint8_t bgAttrMapData = mmu->ReadVRAMDirect(bgMapBaseAddr + (bgMapY * 32) + bgMapX, 1);
-				bgPaletteNum = bgAttrMapData & 0x07;
-				bgTileVRAMBank = (bgAttrMapData & 0x08) >> 3;
-
-				bgXFlip = (bgAttrMapData & 0x20) >> 5;
-				bgYFlip = (bgAttrMapData & 0x40) >> 6;
-				bgTilePriorityBit = (bgAttrMapData & 0x80) >> 7;
-
-				if (bgYFlip)
-				{
-					tileDataL = mmu->ReadVRAMDirect(bgDataBaseAddr + (s_bgDataIndex * 16) + ((7 - tileY) * 2), bgTileVRAMBank);
-					tileDataH = mmu->ReadVRAMDirect(bgDataBaseAddr + (s_bgDataIndex * 16) + ((7 - tileY) * 2) + 1, bgTileVRAMBank);
-				}
-				else
-				{
-					tileDataL = mmu->ReadVRAMDirect(bgDataBaseAddr + (s_bgDataIndex * 16) + (tileY * 2), bgTileVRAMBank);
-					tileDataH = mmu->ReadVRAMDirect(bgDataBaseAddr + (s_bgDataIndex * 16) + (tileY * 2) + 1, bgTileVRAMBank);
-				}
-			}
-
-			if (bgXFlip)
-				tileX = 7 - tileX;
-
-			uint8_t colorIndex = (((tileDataH >> (7 - tileX) & 0x01) << 1) | (tileDataL >> (7 - tileX) & 0x01));
-			WorkingFrameBuffer[currentLine * 160 + screenX] = colorIndex;
-			if (mmu->GetCGBSupport() || mmu->isBootRomEnabled())
-				WorkingColorFrameBuffer[currentLine * 160 + screenX] = mmu->GetBGPColor(bgPaletteNum, colorIndex);
-			else
-				WorkingColorFrameBuffer[currentLine * 160 + screenX] = mmu->GetBGPColor(bgPaletteNum, bgp[colorIndex]);
-			bgPixelPriority[screenX] = bgTilePriorityBit && colorIndex;
-		}
+		RenderTilesCGB(bgMapBaseAddr + (bgMapY * 32), bgDataBaseAddr, tileY, scx, 0);
 	}
 	else
 	{
 		for (int screenX = 0; screenX < 160; screenX++)
 		{
-			WorkingColorFrameBuffer[currentLine * 160 + screenX] = 0xFFFFFFFF;
+			WorkingColorFrameBuffer[state.line * 160 + screenX] = 0xFFFFFFFF;
 		}
+		return;
 	}
 
 	//render window
-	uint8_t wY = mmu->ReadByteDirect(0xFF4A);
-	uint8_t wX = mmu->ReadByteDirect(0xFF4B);
+	uint8_t wY = state.wy;
+	uint8_t wX = state.wx;
 
-	if ((lcdc & WINDOW_ENABLE) && (wY <= currentLine) && windowLYTrigger)
+	if ((lcdc & WINDOW_ENABLE) && (wY <= state.line) && state.windowLYTrigger)
 	{
 		uint8_t windowDrawn = 0;
 		uint16_t winMapBaseAddr = (lcdc & 0x40) ? 0x9C00 : 0x9800;
 		uint16_t winDataBaseAddr = (lcdc & 0x10) ? 0x8000 : 0x9000;
-		uint8_t u_winDataIndex = 0;
-		int8_t s_winDataIndex = 0;
 
-		//uint8_t winMapY = ((currentLine - wY) % 256) >> 3; // Window Map Tile Y
-		//uint8_t tileY = ((currentLine - wY) % 256) & 0x07; // the number of lines from the top of the tile
 
 		uint8_t winMapY = (windowCounter % 256) >> 3; // Window Map Tile Y
 		uint8_t tileY = (windowCounter % 256) & 0x07; // the number of lines from the top of the tile
 
-		for (int screenX = 0; screenX < 160; screenX++)
+		//the window starts at screen x wX - 7, anything left of the screen edge is cut off
+		int startX = (wX < 7) ? 0 : wX - 7;
+		if (startX < 160)
 		{
-			if (screenX + 7 < wX)
-				continue;
-
-			windowDrawn |= 1;
-
-			uint8_t winMapX = (((screenX + 7) - wX) % 256) >> 3; // Window Map Tile X
-			uint8_t tileX = (((screenX + 7) - wX) % 256) & 0x07; // number of pixels from left to right on the tile
-			uint8_t tileDataH, tileDataL;
-			uint8_t winColorIndex = 0;
-			uint8_t winPaletteNum = 0;
-			uint8_t winTileVRAMBank = 0;
-
-			bool winXFlip = 0;
-			bool winYFlip = 0;
-			bool winTilePriorityBit = 0;
-
-			if (winDataBaseAddr == 0x8000)
-			{
-				u_winDataIndex = mmu->ReadVRAMDirect(winMapBaseAddr + (winMapY * 32) + winMapX, 0);
-				uint8_t winAttrMapData = mmu->ReadVRAMDirect(winMapBaseAddr + (winMapY * 32) + winMapX, 1);
-
-				winPaletteNum = winAttrMapData & 0x07;
-				winTileVRAMBank = (winAttrMapData & 0x08) >> 3;
-
-				winXFlip = (winAttrMapData & 0x20) >> 5;
-				winYFlip = (winAttrMapData & 0x40) >> 6;
-				winTilePriorityBit = (winAttrMapData & 0x80) >> 7;
-
-				if (winYFlip)
-				{
-					tileDataL = mmu->ReadVRAMDirect(winDataBaseAddr + (u_winDataIndex * 16) + ((7 - tileY) * 2), winTileVRAMBank);
-					tileDataH = mmu->ReadVRAMDirect(winDataBaseAddr + (u_winDataIndex * 16) + ((7 - tileY) * 2) + 1, winTileVRAMBank);
-				}
-				else
-				{
-					tileDataL = mmu->ReadVRAMDirect(winDataBaseAddr + (u_winDataIndex * 16) + (tileY * 2), winTileVRAMBank);
-					tileDataH = mmu->ReadVRAMDirect(winDataBaseAddr + (u_winDataIndex * 16) + (tileY * 2) + 1, winTileVRAMBank);
-				}
-			}
-			else
-			{
-				s_winDataIndex = mmu->ReadVRAMDirect(winMapBaseAddr + (winMapY * 32) + winMapX, 0);
-				uint8_t winAttrMapData = mmu->ReadVRAMDirect(winMapBaseAddr + (winMapY * 32) + winMapX, 1);
-
-				winPaletteNum = winAttrMapData & 0x07;
-				winTileVRAMBank = (winAttrMapData & 0x08) >> 3;
-
-				winXFlip = (winAttrMapData & 0x20) >> 5;
-				winYFlip = (winAttrMapData & 0x40) >> 6;
-				winTilePriorityBit = (winAttrMapData & 0x80) >> 7;
-
-				if (winYFlip)
-				{
-					tileDataL = mmu->ReadVRAMDirect(winDataBaseAddr + (s_winDataIndex * 16) + ((7 - tileY) * 2), winTileVRAMBank);
-					tileDataH = mmu->ReadVRAMDirect(winDataBaseAddr + (s_winDataIndex * 16) + ((7 - tileY) * 2) + 1, winTileVRAMBank);
-				}
-				else
-				{
-					tileDataL = mmu->ReadVRAMDirect(winDataBaseAddr + (s_winDataIndex * 16) + (tileY * 2), winTileVRAMBank);
-					tileDataH = mmu->ReadVRAMDirect(winDataBaseAddr + (s_winDataIndex * 16) + (tileY * 2) + 1, winTileVRAMBank);
-				}
-			}
-
-			if (winXFlip)
-				tileX = 7 - tileX;
-
-			uint8_t colorIndex = (((tileDataH >> (7 - tileX) & 0x01) << 1) | (tileDataL >> (7 - tileX) & 0x01));
-			WorkingFrameBuffer[currentLine * 160 + screenX] = colorIndex;
-			if (mmu->GetCGBSupport() || mmu->isBootRomEnabled())
-				WorkingColorFrameBuffer[currentLine * 160 + screenX] = mmu->GetBGPColor(winPaletteNum, colorIndex);
-			else
-				WorkingColorFrameBuffer[currentLine * 160 + screenX] = mmu->GetBGPColor(winPaletteNum, bgp[colorIndex]);
-			bgPixelPriority[screenX] = winTilePriorityBit && colorIndex;
+			windowDrawn = 1;
+			RenderTilesCGB(winMapBaseAddr + (winMapY * 32), winDataBaseAddr, tileY, startX + 7 - wX, startX);
 		}
 
 		windowCounter += windowDrawn;
@@ -502,325 +642,369 @@ void Ppu::RenderLineCGB()
 
 
 	//render sprites
+	bool dmgPalettes = state.dmgPalettes; //dmg games run through the dmg palettes first
+	RenderSprites(state);
 
-	if (lcdc & SPRITE_ENABLE)
+	//merge the layers and look up their colours. The mmu keeps the cgb palettes as RGBA, only dmg games need the
+	//background's colours shuffled by BGP first (the sprites already went through OBP0/OBP1)
+	const uint32_t* colors = state.colors;
+	if (dmgPalettes)
 	{
-		uint8_t spriteHeight = 8 + (((lcdc & 0x04) << 1)); // 8 or 16 tall
-		uint8_t obp_zero[4];
-		uint8_t obp_one[4];
-
-		//ignore the bottom 2 bits on the palettes since color index 0x00 is "transparent" for sprites
-		obp_zero[0] = 0x00;
-		obp_zero[1] = (mmu->ReadByteDirect(0xFF48) >> 2) & 0x03;
-		obp_zero[2] = (mmu->ReadByteDirect(0xFF48) >> 4) & 0x03;
-		obp_zero[3] = (mmu->ReadByteDirect(0xFF48) >> 6) & 0x03;
-		obp_one[0] = 0x00;
-		obp_one[1] = (mmu->ReadByteDirect(0xFF49) >> 2) & 0x03;
-		obp_one[2] = (mmu->ReadByteDirect(0xFF49) >> 4) & 0x03;
-		obp_one[3] = (mmu->ReadByteDirect(0xFF49) >> 6) & 0x03;
-
-		for (int pixelX = 8; pixelX < 168; pixelX++)
+		for (int paletteNum = 0; paletteNum < 8; paletteNum++)
 		{
-			//uint8_t minX = 0; //lowest x value that can be drawn over
-
-			for (int i = 0; i < lineSpriteCount; i++)
-			{
-				if (lineSprites[i].x <= pixelX - 8 || lineSprites[i].x > pixelX)
-					continue;
-
-				uint8_t tileY = lineSprites[i].yflip ? ((spriteHeight - 1) - (currentLine - (lineSprites[i].y - 16))) & (spriteHeight - 1) : (currentLine - (lineSprites[i].y - 16)) & (spriteHeight - 1);
-				
-				uint8_t tileDataL = mmu->ReadVRAMDirect((0x8000 + (lineSprites[i].tile_id * 16) + (tileY * 2)), lineSprites[i].vram_bank);
-				uint8_t tileDataH = mmu->ReadVRAMDirect((0x8000 + (lineSprites[i].tile_id * 16) + (tileY * 2) + 1), lineSprites[i].vram_bank);
-				//uint8_t tileDataL = mmu->ReadByteDirect(0x8000 + (lineSprites[i].tile_id * 16) + (tileY * 2));
-				//uint8_t tileDataH = mmu->ReadByteDirect(0x8000 + (lineSprites[i].tile_id * 16) + (tileY * 2) + 1);
-				
-				int16_t coordX = lineSprites[i].x - 8;
-				int subX = (pixelX - 8) - coordX;
-				uint8_t tileX = lineSprites[i].xflip ? 7 - subX : subX;
-				
-				uint8_t color = (((tileDataH >> (7 - tileX) & 0x01) << 1) | (tileDataL >> (7 - tileX) & 0x01));
-				
-				if (lcdc & CGB_BG_PRIORITY)
-				{
-					if (bgPixelPriority[coordX + subX])
-						break;
-					if (lineSprites[i].bg_priority && (WorkingFrameBuffer[currentLine * 160 + coordX + subX] != 0)) //don't draw over background, but do move minX
-						break;
-				}
-				
-				if (color != 0x00) //transparent
-				{
-					if(mmu->GetCGBSupport() || mmu->isBootRomEnabled())
-						WorkingColorFrameBuffer[currentLine * 160 + coordX + subX] = mmu->GetOBPColor(lineSprites[i].colorpalette, color);
-					else
-					{
-						if(lineSprites[i].palette != 0)
-							WorkingColorFrameBuffer[currentLine * 160 + coordX + subX] = mmu->GetOBPColor(lineSprites[i].colorpalette, obp_one[color]);
-						else
-							WorkingColorFrameBuffer[currentLine * 160 + coordX + subX] = mmu->GetOBPColor(lineSprites[i].colorpalette, obp_zero[color]);
-					}
-					break;
-				}
-			}
-
+			for (int color = 0; color < 4; color++)
+				lineColors[(paletteNum * 4) + color] = colors[(paletteNum * 4) + bgp[color]];
 		}
-
+		memcpy(&lineColors[32], &colors[32], 32 * sizeof(uint32_t));
+		colors = lineColors;
 	}
+	compositor.Compose(bgLine, objLine, lcdc & CGB_BG_PRIORITY, 0x3F, bgLine);
+	compositor.Colorize(bgLine, colors, &WorkingColorFrameBuffer[state.line * 160]);
 
 }
 
-void Ppu::RenderLineDMG()
+void Ppu::RenderLineDMG(const LineState& state)
 {
-	uint8_t lcdc = mmu->ReadByteDirect(0xFF40);
-	uint8_t scy = mmu->ReadByteDirect(0xFF42);
-	uint8_t scx = mmu->ReadByteDirect(0xFF43);
+	uint8_t lcdc = state.lcdc;
+	uint8_t scy = state.scy;
+	uint8_t scx = state.scx;
 	uint8_t bgp[4] = { 0 };
 
-	bgp[0] = mmu->ReadByteDirect(0xFF47) & 0x03;
-	bgp[1] = (mmu->ReadByteDirect(0xFF47) >> 2) & 0x03;
-	bgp[2] = (mmu->ReadByteDirect(0xFF47) >> 4) & 0x03;
-	bgp[3] = (mmu->ReadByteDirect(0xFF47) >> 6) & 0x03;
+	bgp[0] = state.bgp & 0x03;
+	bgp[1] = (state.bgp >> 2) & 0x03;
+	bgp[2] = (state.bgp >> 4) & 0x03;
+	bgp[3] = (state.bgp >> 6) & 0x03;
 
 	//render background
 	if (lcdc & BG_ENABLE)
 	{
 		uint16_t bgMapBaseAddr = (lcdc & 0x08) ? 0x9C00 : 0x9800;
 		uint16_t bgDataBaseAddr = (lcdc & 0x10) ? 0x8000 : 0x9000;
-		uint8_t u_bgDataIndex = 0;
-		int8_t s_bgDataIndex = 0;
 
-		uint8_t bgMapY = ((scy + currentLine) % 256) >> 3; // Background Map Tile Y
-		uint8_t tileY = ((scy + currentLine) % 256) & 0x07; // the number of lines from the top of the tile
+		uint8_t bgMapY = ((scy + state.line) % 256) >> 3; // Background Map Tile Y
+		uint8_t tileY = ((scy + state.line) % 256) & 0x07; // the number of lines from the top of the tile
 
-		for (int screenX = 0; screenX < 160; screenX++)
-		{
-			uint8_t bgMapX = ((scx + screenX) % 256) >> 3; // Background Map Tile X
-			uint8_t tileX = ((scx + screenX) % 256) & 0x07; // number of pixels from left to right on the tile
-			uint8_t tileDataH, tileDataL;
-
-			if (bgDataBaseAddr == 0x8000)
-			{
-				u_bgDataIndex = mmu->ReadByteDirect(bgMapBaseAddr + (bgMapY * 32) + bgMapX);
-
-				tileDataL = mmu->ReadByteDirect(bgDataBaseAddr + (u_bgDataIndex * 16) + (tileY * 2));
-				tileDataH = mmu->ReadByteDirect(bgDataBaseAddr + (u_bgDataIndex * 16) + (tileY * 2) + 1);
-			}
-			else
-			{
-				s_bgDataIndex = mmu->ReadByteDirect(bgMapBaseAddr + (bgMapY * 32) + bgMapX);
-
-				tileDataL = mmu->ReadByteDirect(bgDataBaseAddr + (s_bgDataIndex * 16) + (tileY * 2));
-				tileDataH = mmu->ReadByteDirect(bgDataBaseAddr + (s_bgDataIndex * 16) + (tileY * 2) + 1);
-			}
-
-			WorkingFrameBuffer[currentLine * 160 + screenX] = bgp[(((tileDataH >> (7 - tileX) & 0x01) << 1) | (tileDataL >> (7 - tileX) & 0x01))];
-		}
+		RenderTilesDMG(state, bgMapBaseAddr + (bgMapY * 32), bgDataBaseAddr, tileY, scx, 0, bgp);
 	}
 	else
 	{
 		for (int screenX = 0; screenX < 160; screenX++)
 		{
-			WorkingFrameBuffer[currentLine * 160 + screenX] = 0x00;
+			WorkingFrameBuffer[state.line * 160 + screenX] = 0x00;
 		}
 	}
 
 	//render window
-	uint8_t wY = mmu->ReadByteDirect(0xFF4A);
-	uint8_t wX = mmu->ReadByteDirect(0xFF4B);
+	uint8_t wY = state.wy;
+	uint8_t wX = state.wx;
 
-	if ((lcdc & WINDOW_ENABLE) && (lcdc & BG_ENABLE) && (wY <= currentLine) && windowLYTrigger)
+	if ((lcdc & WINDOW_ENABLE) && (lcdc & BG_ENABLE) && (wY <= state.line) && state.windowLYTrigger)
 	{
 		uint8_t windowDrawn = 0;
 		uint16_t winMapBaseAddr = (lcdc & 0x40) ? 0x9C00 : 0x9800;
 		uint16_t winDataBaseAddr = (lcdc & 0x10) ? 0x8000 : 0x9000;
-		uint8_t u_winDataIndex = 0;
-		int8_t s_winDataIndex = 0;
 
-		//uint8_t winMapY = ((currentLine - wY) % 256) >> 3; // Window Map Tile Y
-		//uint8_t tileY = ((currentLine - wY) % 256) & 0x07; // the number of lines from the top of the tile
 
 		uint8_t winMapY = (windowCounter % 256) >> 3; // Window Map Tile Y
 		uint8_t tileY = (windowCounter % 256) & 0x07; // the number of lines from the top of the tile
 
-		for (int screenX = 0; screenX < 160; screenX++)
+		//the window starts at screen x wX - 7, anything left of the screen edge is cut off
+		int startX = (wX < 7) ? 0 : wX - 7;
+		if (startX < 160)
 		{
-			if (screenX + 7 < wX)
-				continue;
-
-			windowDrawn |= 1;
-
-			uint8_t winMapX = (((screenX + 7) - wX) % 256) >> 3; // Window Map Tile X
-			uint8_t tileX = (((screenX + 7) - wX) % 256) & 0x07; // number of pixels from left to right on the tile
-			uint8_t tileDataH, tileDataL;
-
-			if (winDataBaseAddr == 0x8000)
-			{
-				u_winDataIndex = mmu->ReadByteDirect(winMapBaseAddr + (winMapY * 32) + winMapX);
-
-				tileDataL = mmu->ReadByteDirect(winDataBaseAddr + (u_winDataIndex * 16) + (tileY * 2));
-				tileDataH = mmu->ReadByteDirect(winDataBaseAddr + (u_winDataIndex * 16) + (tileY * 2) + 1);
-			}
-			else
-			{
-				s_winDataIndex = mmu->ReadByteDirect(winMapBaseAddr + (winMapY * 32) + winMapX);
-
-				tileDataL = mmu->ReadByteDirect(winDataBaseAddr + (s_winDataIndex * 16) + (tileY * 2));
-				tileDataH = mmu->ReadByteDirect(winDataBaseAddr + (s_winDataIndex * 16) + (tileY * 2) + 1);
-			}
-
-			WorkingFrameBuffer[currentLine * 160 + screenX] = bgp[(((tileDataH >> (7 - tileX) & 0x01) << 1) | (tileDataL >> (7 - tileX) & 0x01))];
+			windowDrawn = 1;
+			RenderTilesDMG(state, winMapBaseAddr + (winMapY * 32), winDataBaseAddr, tileY, startX + 7 - wX, startX, bgp);
 		}
 
 		windowCounter += windowDrawn;
 	}
 
-	//render sprites
-
-	if (lcdc & SPRITE_ENABLE)
+	//render sprites, then merge them over the background
+	if ((lcdc & SPRITE_ENABLE) && state.spriteCount > 0)
 	{
-		uint8_t spriteHeight = 8 + (((lcdc & 0x04) << 1)); // 8 or 16 tall
-		uint8_t obp_zero[4] = { 0 };
-		uint8_t obp_one[4] = { 0 };
+		RenderSprites(state);
+		uint8_t* line = &WorkingFrameBuffer[state.line * 160];
+		compositor.Compose(line, objLine, true, 0x03, line);
+	}
 
-		//ignore the bottom 2 bits on the palettes since color index 0x00 is "transparent" for sprites
-		obp_zero[0] = 0x00;
-		obp_zero[1] = (mmu->ReadByteDirect(0xFF48) >> 2) & 0x03;
-		obp_zero[2] = (mmu->ReadByteDirect(0xFF48) >> 4) & 0x03;
-		obp_zero[3] = (mmu->ReadByteDirect(0xFF48) >> 6) & 0x03;
-		obp_one[0] = 0x00;
-		obp_one[1] = (mmu->ReadByteDirect(0xFF49) >> 2) & 0x03;
-		obp_one[2] = (mmu->ReadByteDirect(0xFF49) >> 4) & 0x03;
-		obp_one[3] = (mmu->ReadByteDirect(0xFF49) >> 6) & 0x03;
+}
 
-		for (int pixelX = 8; pixelX < 168; pixelX++)
-		{
-			//uint8_t minX = 0; //lowest x value that can be drawn over
+//Fill objLine with the current line's sprites, in the format Compositor expects. Each sprite is drawn once, in
+//lineSprites order, into the pixels a sprite before it hasn't already covered with an opaque pixel. So each pixel ends
+//up with the first opaque sprite there, and is marked behind the background if that sprite or any before it that
+//covers the pixel has the priority bit set. Whether the background actually hides it is up to the compositor.
+//dmg games (and dmg mode) map the colours through OBP0/OBP1 first
+void Ppu::RenderSprites(const LineState& state)
+{
+	uint8_t lcdc = state.lcdc;
+	bool dmgPalettes = state.dmgPalettes || !state.cgbMode;
+	memset(objLine, 0, sizeof(objLine));
 
-			for (int i = 0; i < lineSpriteCount; i++)
-			{
-				if (lineSprites[i].x <= pixelX - 8 || lineSprites[i].x > pixelX)
-					continue;
-
-				uint8_t tileY = lineSprites[i].yflip ? ((spriteHeight - 1) - (currentLine - (lineSprites[i].y - 16))) & (spriteHeight - 1) : (currentLine - (lineSprites[i].y - 16)) & (spriteHeight - 1);
-				uint8_t tileDataL = mmu->ReadByteDirect(0x8000 + (lineSprites[i].tile_id * 16) + (tileY * 2));
-				uint8_t tileDataH = mmu->ReadByteDirect(0x8000 + (lineSprites[i].tile_id * 16) + (tileY * 2) + 1);
-				int16_t coordX = lineSprites[i].x - 8;
-				int subX = (pixelX - 8) - coordX;
-				uint8_t tileX = lineSprites[i].xflip ? 7 - subX : subX;
-				uint8_t color = (((tileDataH >> (7 - tileX) & 0x01) << 1) | (tileDataL >> (7 - tileX) & 0x01));
-				if (lineSprites[i].bg_priority && (WorkingFrameBuffer[currentLine * 160 + coordX + subX] != 0)) //don't draw over background, but do move minX
-				{
-					break;
-				}
-				else if (color != 0x00) //transparent
-				{
-					if (lineSprites[i].palette)
-						WorkingFrameBuffer[currentLine * 160 + coordX + subX] = obp_one[color];
-					else
-						WorkingFrameBuffer[currentLine * 160 + coordX + subX] = obp_zero[color];
-
-					break;
-				}
-			}
+	if (!(lcdc & SPRITE_ENABLE))
+		return;
 
-		}		
+	uint8_t spriteHeight = 8 + (((lcdc & 0x04) << 1)); // 8 or 16 tall
+	uint8_t dmgBank = state.vramBank; //no vram banking on dmg, but the register still works in this mode
+	bool cgbMode = state.cgbMode;
+	const uint8_t cgbColors[4] = { 0, 1, 2, 3 };
+	uint8_t obp_zero[4];
+	uint8_t obp_one[4];
+
+	//ignore the bottom 2 bits on the palettes since color index 0x00 is "transparent" for sprites
+	obp_zero[0] = 0x00;
+	obp_zero[1] = (state.obp0 >> 2) & 0x03;
+	obp_zero[2] = (state.obp0 >> 4) & 0x03;
+	obp_zero[3] = (state.obp0 >> 6) & 0x03;
+	obp_one[0] = 0x00;
+	obp_one[1] = (state.obp1 >> 2) & 0x03;
+	obp_one[2] = (state.obp1 >> 4) & 0x03;
+	obp_one[3] = (state.obp1 >> 6) & 0x03;
+
+	for (int i = 0; i < state.spriteCount; i++)
+	{
+		const Sprite& sprite = state.sprites[i];
+		int coordX = sprite.x - 8;
+		if (coordX <= -8 || coordX >= 160)
+			continue;
+
+		uint8_t tileY = sprite.yflip ? ((spriteHeight - 1) - (state.line - (sprite.y - 16))) & (spriteHeight - 1) : (state.line - (sprite.y - 16)) & (spriteHeight - 1);
+		uint8_t bank = cgbMode ? sprite.vram_bank : dmgBank;
+		const uint8_t* tileRow = drawTiles->GetRow(bank, sprite.tile_id + (tileY >> 3), tileY & 0x07, sprite.xflip);
+
+		const uint8_t* colors = dmgPalettes ? (sprite.palette ? obp_one : obp_zero) : cgbColors;
+		uint8_t behind = sprite.bg_priority ? Compositor::OBJ_BEHIND_BG : 0;
+		uint8_t opaqueBits = Compositor::OBJ_OPAQUE | Compositor::OBJ_TABLE | (sprite.colorpalette << 2);
+
+		int firstX = std::max(0, -coordX);
+		int lastX = std::min(8, 160 - coordX);
+		for (int subX = firstX; subX < lastX; subX++)
+		{
+			uint8_t& code = objLine[coordX + subX];
+			if (code & Compositor::OBJ_OPAQUE) //a sprite before this one already covers the pixel
+				continue;
 
+			uint8_t color = tileRow[subX];
+			code |= behind;
+			if (color != 0x00) //transparent
+				code |= opaqueBits | colors[color];
+		}
 	}
-
 }
 
+//The finished frame is written straight to wherever it's shown from: the frame exchange's back buffer, the texture's own
+//memory if it's a streaming texture, or ColorFrameBuffer to be uploaded from if neither. dmg frames get their colours
+//(and are blended with the frame before) on the way. Only the lines that changed since the last frame are redone, and
+//a frame that didn't change at all isn't uploaded or published
 void Ppu::RenderFrame()
 {
-	if (mmu->GetCGBMode())
+	bool cgbMode = mmu->GetCGBMode();
+	int firstLine = 0;
+	int lastLine = 143;
+#if KGB_SKIP_UNCHANGED_FRAMES
+	frameUnchanged = !FindChangedLines(firstLine, lastLine);
+	if (frameUnchanged)
 	{
-		memcpy(PrevColorFrameBuffer, ColorFrameBuffer, sizeof(uint32_t) * 160 * 144);
-		memcpy(ColorFrameBuffer, WorkingColorFrameBuffer, sizeof(uint32_t) * 160 * 144);
+		if (!cgbMode)
+			memcpy(FrameBuffer, WorkingFrameBuffer, sizeof(uint8_t) * 160 * 144);
+		if (frameExchange) //main keeps showing the last frame it took
+			return;
+
+		//the texture already holds this frame, but it's still presented: without audio the vsync'd present is what keeps
+		//emulation running at the right speed
+		SDL_RenderClear(ppuRenderer);
+		SDL_RenderCopy(ppuRenderer, ppuTexture, NULL, NULL);
+		SDL_RenderPresent(ppuRenderer);
+		return;
 	}
-	else
+	if (frameExchange) //the back buffer last held the frame before the one on screen, so all of it has to be redone
+	{
+		firstLine = 0;
+		lastLine = 143;
+	}
+#endif
+
+	//out is the first line to be written
+	SDL_Rect lines = { 0, firstLine, 160, lastLine - firstLine + 1 };
+	uint32_t* out = &ColorFrameBuffer[firstLine * 160];
+	int pitch = 160;
+	bool locked = false;
+	if (frameExchange)
+		out = frameExchange->GetBackBuffer();
+	else if (streamingTexture)
 	{
-		for (int y = 0; y < 144; y++)
+		void* pixels;
+		int bytePitch;
+		if (SDL_LockTexture(ppuTexture, &lines, &pixels, &bytePitch) == 0)
 		{
-			for (int x = 0; x < 160; x++)
-			{
-				PrevColorFrameBuffer[y * 160 + x] = palette[FrameBuffer[y * 160 + x]];
-			}
+			out = (uint32_t*)pixels;
+			pitch = bytePitch / 4;
+			locked = true;
 		}
+	}
+
+	if (cgbMode)
+	{
+		for (int y = firstLine; y <= lastLine; y++)
+			memcpy(&out[(y - firstLine) * pitch], &WorkingColorFrameBuffer[y * 160], sizeof(uint32_t) * 160);
+	}
+	else
+	{
+		//one pass a line: the pair of shades each pixel goes between picks its colour
+		for (int y = firstLine; y <= lastLine; y++)
+			compositor.ColorizePairs(&FrameBuffer[y * 160], &WorkingFrameBuffer[y * 160], pairColors, &out[(y - firstLine) * pitch]);
 		memcpy(FrameBuffer, WorkingFrameBuffer, sizeof(uint8_t) * 160 * 144);
-		for (int y = 0; y < 144; y++)
-		{
-			for (int x = 0; x < 160; x++)
-			{
-				ColorFrameBuffer[y * 160 + x] = palette[FrameBuffer[y * 160 + x]];
-			}
-		}
-		
-		for (int y = 0; y < 144; y++)
-		{
-			for (int x = 0; x < 160; x++)
-			{
-				uint32_t red   = ((((ColorFrameBuffer[y * 160 + x] & 0xFF000000) >> 24) + ((PrevColorFrameBuffer[y * 160 + x] & 0xFF000000) >> 24)) / 2) << 24;
-				uint32_t green = ((((ColorFrameBuffer[y * 160 + x] & 0x00FF0000) >> 16) + ((PrevColorFrameBuffer[y * 160 + x] & 0x00FF0000) >> 16)) / 2) << 16;
-				uint32_t blue  = ((((ColorFrameBuffer[y * 160 + x] & 0x0000FF00) >>  8) + ((PrevColorFrameBuffer[y * 160 + x] & 0x0000FF00) >>  8)) / 2) <<  8;
-				uint32_t alpha = 0x000000FF;
-				ColorFrameBuffer[y * 160 + x] = red | green | blue | alpha;
-			}
-		}
 	}
-	
+
+	if (frameExchange)
+	{
+		frameExchange->Publish();
+		return;
+	}
+
 	SDL_RenderClear(ppuRenderer);
 	/*SDL_UpdateTexture(ppuBlendTexture, NULL, PrevColorFrameBuffer, 4 * 160);
 	SDL_RenderCopy(ppuRenderer, ppuBlendTexture, NULL, NULL);*/
 	
-	SDL_UpdateTexture(ppuTexture, NULL, ColorFrameBuffer, 4 * 160);
+	if (locked)
+		SDL_UnlockTexture(ppuTexture);
+	else
+		SDL_UpdateTexture(ppuTexture, &lines, out, 4 * 160);
 	SDL_RenderCopy(ppuRenderer, ppuTexture, NULL, NULL);
 	SDL_RenderPresent(ppuRenderer);
 
 }
 
+//Hash each line of the frame about to be shown, and find the first and last that differ from the last frame's. For
+//dmg that's the shades each pixel is coloured from, this frame's and the last's, which decide the output as long as
+//pairColors doesn't change. Returns false if none did
+bool Ppu::FindChangedLines(int& firstLine, int& lastLine)
+{
+	bool cgbMode = mmu->GetCGBMode();
+	firstLine = 144;
+	lastLine = -1;
+	for (int y = 0; y < 144; y++)
+	{
+		uint64_t hash;
+		if (cgbMode)
+			hash = HashLine(&WorkingColorFrameBuffer[y * 160], sizeof(uint32_t) * 160, 0);
+		else
+			hash = HashLine(&WorkingFrameBuffer[y * 160], 160, HashLine(&FrameBuffer[y * 160], 160, 0));
+
+		if (hash != lineHashes[y] || refreshFrame)
+		{
+			lineHashes[y] = hash;
+			firstLine = std::min(firstLine, y);
+			lastLine = y;
+		}
+	}
+	refreshFrame = false;
+	return lastLine >= 0;
+}
+
+//Not cryptographic, just has to make any change to a line show up. Each step is reversible, so any one 8 byte word
+//changing always changes the result
+uint64_t Ppu::HashLine(const void* data, size_t length, uint64_t seed)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	uint64_t hash = seed ^ 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < length; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, &bytes[i], 8);
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 32;
+	}
+	return hash;
+}
+
+void Ppu::RefreshFrame()
+{
+	refreshFrame = true;
+}
+
+bool Ppu::IsFrameUnchanged()
+{
+	return frameUnchanged;
+}
+
+//Work out the 16 colours a dmg pixel can come out as. Blending averages each channel of the two shades' colours
+void Ppu::UpdatePairColors()
+{
+	for (int previous = 0; previous < 4; previous++)
+	{
+		for (int current = 0; current < 4; current++)
+		{
+			uint32_t currentColor = palette[current];
+			uint32_t previousColor = palette[previous];
+			uint32_t color = currentColor;
+			if (blendFrames)
+			{
+				uint32_t red   = ((((currentColor & 0xFF000000) >> 24) + ((previousColor & 0xFF000000) >> 24)) / 2) << 24;
+				uint32_t green = ((((currentColor & 0x00FF0000) >> 16) + ((previousColor & 0x00FF0000) >> 16)) / 2) << 16;
+				uint32_t blue  = ((((currentColor & 0x0000FF00) >>  8) + ((previousColor & 0x0000FF00) >>  8)) / 2) <<  8;
+				uint32_t alpha = 0x000000FF;
+				color = red | green | blue | alpha;
+			}
+			pairColors[(previous << 2) | current] = color;
+		}
+	}
+}
+
 void Ppu::SpriteSearch()
 {
 	lineSpriteCount = 0;
 	lineSprites.fill(Sprite());
 
-	uint16_t OAMBaseAddr = 0xFE00;
 	uint8_t lcdc = mmu->ReadByteDirect(0xFF40);
 
 	if (!(lcdc & SPRITE_ENABLE))
 		return;
 
+	if (mmu->oamChanged)
+		DecodeOAM();
+
 	uint8_t spriteHeight = 8 + ((lcdc & 0x04) << 1);
+	for (int i = 0; i < 40 && lineSpriteCount < 10; i++)
+	{
+		if (currentLine + 16 >= allSprites[i].y && currentLine + 16 < allSprites[i].y + spriteHeight) //this sprite crosses the current draw line
+		{
+			lineSprites[lineSpriteCount] = allSprites[i];
+			lineSprites[lineSpriteCount].index = lineSpriteCount;
+			if (spriteHeight > 8) { lineSprites[lineSpriteCount].tile_id &= 0xFE; };
+			lineSpriteCount++;
+		}
+	}
+	
+	if(lineSpriteCount > 0 && !mmu->GetCGBMode())
+		std::sort(lineSprites.begin(), lineSprites.end());
+
+	return;
+}
+
+//OAM usually only changes once a frame, by DMA, so the sprites are kept decoded in allSprites between changes
+void Ppu::DecodeOAM()
+{
+	uint16_t OAMBaseAddr = 0xFE00;
+	bool cgbMode = mmu->GetCGBMode();
+
 	for (int i = 0; i < 40; i++)
 	{
 		uint8_t offset = i * 4;
 
 		allSprites[i].y = mmu->ReadByteDirect(OAMBaseAddr + offset);
 		allSprites[i].x = mmu->ReadByteDirect(OAMBaseAddr + offset + 1);
-		allSprites[i].tile_id = mmu->ReadByteDirect(OAMBaseAddr + offset + 2);
-		if (spriteHeight > 8) { allSprites[i].tile_id &= 0xFE; };
+		allSprites[i].tile_id = mmu->ReadByteDirect(OAMBaseAddr + offset + 2); //tall sprites clear bit 0, done as they're picked since lcdc can change
 		uint8_t spriteAttribData = mmu->ReadByteDirect(OAMBaseAddr + offset + 3);
 		allSprites[i].bg_priority = spriteAttribData & 0x80;
 		allSprites[i].yflip = spriteAttribData & 0x40;
 		allSprites[i].xflip = spriteAttribData & 0x20;
-		if (mmu->GetCGBMode())
+		if (cgbMode)
 		{
 			allSprites[i].vram_bank = (spriteAttribData & 0x08) >> 3;
 			allSprites[i].colorpalette = spriteAttribData & 0x07;
 		}
 		allSprites[i].palette = (spriteAttribData & 0x10) >> 4;
 	}
-	for (int i = 0; i < 40 && lineSpriteCount < 10; i++)
-	{
-		if (currentLine + 16 >= allSprites[i].y && currentLine + 16 < allSprites[i].y + spriteHeight) //this sprite crosses the current draw line
-		{
-			lineSprites[lineSpriteCount] = allSprites[i];
-			lineSprites[lineSpriteCount].index = lineSpriteCount;
-			lineSpriteCount++;
-		}
-	}
-	
-	if(lineSpriteCount > 0 && !mmu->GetCGBMode())
-		std::sort(lineSprites.begin(), lineSprites.end());
 
-	return;
-}
\ No newline at end of file
+	mmu->oamChanged = false;
+}
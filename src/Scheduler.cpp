@@ -0,0 +1,45 @@
+#include "Scheduler.h"
+
+Scheduler::Scheduler(SyncCallback __callback, void* __user) : callback(__callback), user(__user)
+{
+}
+
+uint64_t Scheduler::TakePending()
+{
+	uint64_t cycles = pending;
+	now += pending;
+	pending = 0;
+	return cycles;
+}
+
+void Scheduler::Schedule(EVENT event, uint64_t cycles)
+{
+	if (cycles > MaxEventDistance)
+		cycles = MaxEventDistance;
+	events[event] = now + cycles;
+	UpdateNextEvent();
+}
+
+void Scheduler::Sync()
+{
+	//nothing pending means either everything is already up to date, or this is a register access made while catching up
+	if (pending == 0)
+		return;
+	callback(user);
+}
+
+void Scheduler::RegisterWritten()
+{
+	events[REGISTER_WRITE] = now;
+	nextEvent = now;
+}
+
+void Scheduler::UpdateNextEvent()
+{
+	nextEvent = events[0];
+	for (int i = 1; i < EVENT_COUNT; i++)
+	{
+		if (events[i] < nextEvent)
+			nextEvent = events[i];
+	}
+}
@@ -0,0 +1,38 @@
+#include "TileCache.h"
+
+TileCache::TileCache(const std::array<std::array<uint8_t, 0x2000>, 2>& __vram) : vram(__vram)
+{
+	InvalidateAll();
+}
+
+void TileCache::InvalidateRange(uint8_t bank, uint16_t addr, uint16_t length)
+{
+	for (uint32_t a = addr & 0xFFF0; a < (uint32_t)addr + length && a < 0x1800; a += 16)
+		dirty[bank][a >> 4] = true;
+}
+
+void TileCache::InvalidateAll()
+{
+	for (int bank = 0; bank < 2; bank++)
+	{
+		for (int tile = 0; tile < TILE_COUNT; tile++)
+			dirty[bank][tile] = true;
+	}
+}
+
+void TileCache::Decode(uint8_t bank, uint16_t tile)
+{
+	const uint8_t* data = &vram[bank][tile << 4];
+	for (int row = 0; row < 8; row++)
+	{
+		uint8_t tileDataL = data[row * 2];
+		uint8_t tileDataH = data[row * 2 + 1];
+		for (int x = 0; x < 8; x++)
+		{
+			uint8_t color = (((tileDataH >> (7 - x)) & 0x01) << 1) | ((tileDataL >> (7 - x)) & 0x01);
+			pixels[0][bank][tile][row][x] = color;
+			pixels[1][bank][tile][row][7 - x] = color;
+		}
+	}
+	dirty[bank][tile] = false;
+}
@@ -0,0 +1,129 @@
+#include "Timer.h"
+
+Timer::Timer(uint16_t __divCounter) : divCounter(__divCounter)
+{
+}
+
+bool Timer::Advance(uint64_t cycles)
+{
+	clock += cycles;
+	if (clock < overflowTime)
+		return false;
+	return UpdateTima();
+}
+
+uint64_t Timer::CyclesUntilOverflow()
+{
+	if (overflowTime == UINT64_MAX)
+		return UINT64_MAX;
+	return (overflowTime > clock) ? overflowTime - clock : 0;
+}
+
+uint8_t Timer::ReadDIV()
+{
+	return (uint16_t)(divCounter + (clock - divTime)) >> 8;
+}
+
+uint8_t Timer::ReadTIMA()
+{
+	//overflows are always handled by Advance, so this can't wrap
+	if (!(tac & 0x04))
+		return tima;
+	return tima + (uint8_t)((timerCycles + (clock - timaTime)) / Thresholds[tac & 0x03]);
+}
+
+uint8_t Timer::ReadTMA()
+{
+	return tma;
+}
+
+uint8_t Timer::ReadTAC()
+{
+	return tac;
+}
+
+void Timer::WriteDIV()
+{
+	divCounter = 0;
+	divTime = clock;
+}
+
+void Timer::WriteTIMA(uint8_t val)
+{
+	UpdateTima();
+	tima = val;
+	UpdateOverflowTime();
+}
+
+void Timer::WriteTMA(uint8_t val)
+{
+	tma = val;
+}
+
+void Timer::WriteTAC(uint8_t val)
+{
+	//time up to now counts at the old rate. Leftover cycles carry over to the new one
+	UpdateTima();
+	tac = val;
+	UpdateOverflowTime();
+}
+
+uint8_t Timer::ReadRegister(void* timer, uint16_t addr)
+{
+	Timer* t = (Timer*)timer;
+	switch (addr)
+	{
+	case(0xFF04): return t->ReadDIV();
+	case(0xFF05): return t->ReadTIMA();
+	case(0xFF06): return t->ReadTMA();
+	default:      return t->ReadTAC();
+	}
+}
+
+void Timer::WriteRegister(void* timer, uint16_t addr, uint8_t val)
+{
+	Timer* t = (Timer*)timer;
+	switch (addr)
+	{
+	case(0xFF04): t->WriteDIV(); break;
+	case(0xFF05): t->WriteTIMA(val); break;
+	case(0xFF06): t->WriteTMA(val); break;
+	default:      t->WriteTAC(val); break;
+	}
+}
+
+//Bring tima up to the current time, reloading it from TMA for every overflow along the way.
+//Returns true if it overflowed
+bool Timer::UpdateTima()
+{
+	bool overflowed = false;
+	if (tac & 0x04)
+	{
+		uint16_t threshold = Thresholds[tac & 0x03];
+		timerCycles += clock - timaTime;
+		uint64_t increments = timerCycles / threshold;
+		timerCycles -= increments * threshold;
+
+		while (increments >= (uint64_t)(0x100 - tima))
+		{
+			increments -= 0x100 - tima;
+			tima = tma;
+			overflowed = true;
+		}
+		tima += (uint8_t)increments;
+	}
+	timaTime = clock;
+	UpdateOverflowTime();
+	return overflowed;
+}
+
+void Timer::UpdateOverflowTime()
+{
+	if (!(tac & 0x04))
+	{
+		overflowTime = UINT64_MAX;
+		return;
+	}
+	uint64_t overflowCycles = (uint64_t)(0x100 - tima) * Thresholds[tac & 0x03];
+	overflowTime = timaTime + ((overflowCycles > timerCycles) ? overflowCycles - timerCycles : 0);
+}
@@ -6,6 +6,8 @@
 #include <vector>
 #include <cassert>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <SDL.h>
 #include "Mmu.h"
 #include "Cpu.h"
@@ -13,6 +15,506 @@
 #include "Apu.h"
 #include "Serial.h"
 #include "Stopwatch.h"
+#include "FrameExchange.h"
+#include "SpscQueue.h"
+
+//State shared between main and the emulation thread (see KGB_EMULATION_THREAD in Config.h). Main keeps the window,
+//renderer and input devices, everything else belongs to the emulation thread while it's running
+struct Emulation
+{
+	Cpu* cpu{ nullptr };
+	Mmu* mmu{ nullptr };
+	Ppu* ppu{ nullptr };
+	Apu* apu{ nullptr };
+	Serial* linkCable{ nullptr };
+
+	SpscQueue<SDL_Event, 256> events; //input and window events passed on by main, handled at the end of each frame
+	std::atomic<bool> quit{ false };
+	std::atomic<float> rumble{ 0.0f }; //strength of the rumble main should play next, 0 for none
+
+	std::mutex titleLock;
+	std::string title;
+};
+
+//Run the emulator forward: as far as the audio device has asked for, or a whole frame without audio.
+//Returns true when a frame has finished, which is when the title, rumble and input are seen to
+static bool RunEmulation(Cpu* cpu, Mmu* mmu, Apu* apu, Serial* linkCable)
+{
+	if (linkCable)
+		linkCable->Tick();
+
+	if (apu == nullptr)
+	{
+		//run one frame
+		do
+		{
+			cpu->Tick();
+		} while (cpu->GetFrameCycles() < (456 * 154) * mmu->DMASpeed);
+	}
+	else
+	{
+		static double carry_time = 0;
+		
+		//int samples_ready = SDL_AudioStreamAvailable(apu->audio_stream);
+		//if (samples_ready < cpu->audio_frames_requested)
+		SDL_LockAudioDevice(cpu->audio_device);
+		if(cpu->audio_frames_requested > 0)
+		{
+			unsigned int cpu_ticks = cpu->audio_frames_requested;// -samples_ready; //audio frames requested
+			cpu->audio_frames_requested = 0;
+			double accurate_ticks;
+			if (cpu->GetDoubleSpeedMode())
+				accurate_ticks = (double)cpu_ticks * cpu->GetThrottle() * ((double)0x800000 / (double)48000) + carry_time;
+			else
+				accurate_ticks = (double)cpu_ticks * cpu->GetThrottle() * ((double)0x400000 / (double)48000) + carry_time;
+
+
+			uint64_t pre_update_cpu_cycles = cpu->GetTotalCycles();
+			
+			while ((cpu->GetTotalCycles() - pre_update_cpu_cycles) < accurate_ticks) //tick emulator forward and fill audio buffer
+			{
+				uint64_t tick_cycles = cpu->GetTotalCycles();
+				cpu->Tick();
+				tick_cycles = cpu->GetTotalCycles() - tick_cycles;
+
+				cpu->apu->Update(tick_cycles, cpu->GetDoubleSpeedMode());
+			}
+			
+
+			carry_time = (cpu->GetTotalCycles() - pre_update_cpu_cycles) - accurate_ticks;
+			cpu->frame_mus = cpu->watch.elapsed<stopwatch::mus>();
+			cpu->running_frame_times[cpu->frame_time_index] = cpu->frame_mus;
+			cpu->frame_time_index = (cpu->frame_time_index + 1) % 60;
+			
+			cpu->average_cycles_per_frame[cpu->avg_cycles_index] = cpu->GetTotalCycles() - pre_update_cpu_cycles;
+			cpu->avg_cycles_index = (cpu->avg_cycles_index + 1) % 60;
+			
+			if (cpu->title_timer.elapsed<stopwatch::ms>() > 200)
+			{
+				cpu->average_frame_mus = 0;
+				for (int i = 0; i < 60; i++)
+					cpu->average_frame_mus += cpu->running_frame_times[i];
+				cpu->average_frame_mus = cpu->average_frame_mus / 60;
+
+				cpu->avg_cycles = 0;
+				for (int i = 0; i < 60; i++)
+					cpu->avg_cycles += cpu->average_cycles_per_frame[i];
+				cpu->avg_cycles = cpu->avg_cycles / 60;
+
+				cpu->title_timer.start();
+
+				//double fps = ((double)(cpu->GetTotalCycles() - pre_update_cpu_cycles) * 1000000.0) / (70224.0 * ((double)cpu->average_frame_mus));
+				double fps = ((double)(cpu->avg_cycles) * 1000000.0) / (70224.0 * ((double)cpu->average_frame_mus));
+				if (cpu->GetDoubleSpeedMode())
+					fps *= 0.5;
+				cpu->titlestream.str(std::string());
+				//cpu->titlestream.precision(4);// << std::setprecision(4);
+				cpu->titlestream << "KGB    FPS: ";
+				cpu->titlestream << fps;
+			}
+			cpu->watch.start();
+
+		}
+		SDL_UnlockAudioDevice(cpu->audio_device);
+	}
+
+	if (cpu->GetFrameCycles() > (456 * 154) * mmu->DMASpeed)
+	{
+		cpu->SetFrameCycles(cpu->GetFrameCycles() - ((456 * 154) * mmu->DMASpeed));
+		return true;
+	}
+	return false;
+}
+
+//How hard to rumble for the frame that just finished, 0 for not at all
+static float TakeRumble(Mmu* mmu)
+{
+	float strength = (float)((double)mmu->rumbleStrength / (double)((456 * 154) * mmu->DMASpeed));
+	mmu->rumbleStrength = 0;
+	return strength;
+}
+
+//Input and window events that change the emulator's state
+static void HandleEvent(const SDL_Event& e, Cpu* cpu, Mmu* mmu, Ppu* ppu, Apu* apu)
+{
+	switch (e.type)
+	{
+	case(SDL_WINDOWEVENT):
+	{
+		switch (e.window.event)
+		{
+		case(SDL_WINDOWEVENT_EXPOSED):
+		{
+			ppu->RefreshFrame();
+			break;
+		}
+		case(SDL_WINDOWEVENT_MOVED):
+		{
+			if (cpu->apu)
+			{
+				SDL_LockAudioDevice(cpu->audio_device);
+				SDL_AudioStreamClear(cpu->apu->audio_stream);
+				SDL_ClearQueuedAudio(cpu->audio_device);
+				cpu->audio_frames_requested = 0;
+				SDL_UnlockAudioDevice(cpu->audio_device);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+		break;
+	}
+	case(SDL_KEYDOWN):
+	{
+		uint8_t ifreg = mmu->ReadByteDirect(0xFF0F);
+		if (mmu->ReadByteDirect(0xFF00) & (0x10 || 0x20))
+			mmu->WriteByteDirect(0xFF0F, ifreg | 0x10);
+		switch (e.key.keysym.scancode)
+		{
+		case SDL_SCANCODE_W:
+		case SDL_SCANCODE_UP:
+			//press up;
+			mmu->Joypad.directions &= ~(mmu->Joypad.up);
+			break;
+
+		case SDL_SCANCODE_S:
+		case SDL_SCANCODE_DOWN:
+			//press down
+			mmu->Joypad.directions &= ~(mmu->Joypad.down);
+			break;
+
+		case SDL_SCANCODE_A:
+		case SDL_SCANCODE_LEFT:
+			//press left
+			mmu->Joypad.directions &= ~(mmu->Joypad.left);
+			break;
+
+		case SDL_SCANCODE_D:
+		case SDL_SCANCODE_RIGHT:
+			//press right
+			mmu->Joypad.directions &= ~(mmu->Joypad.right);
+			break;
+
+		case SDL_SCANCODE_Z:
+		case SDL_SCANCODE_N:
+			//press B
+			mmu->Joypad.buttons &= ~(mmu->Joypad.b_button);
+			break;
+
+		case SDL_SCANCODE_X:
+		case SDL_SCANCODE_M:
+			//press A
+			mmu->Joypad.buttons &= ~(mmu->Joypad.a_button);
+			break;
+
+		case SDL_SCANCODE_RSHIFT:
+		case SDL_SCANCODE_LSHIFT:
+			//press select
+			mmu->Joypad.buttons &= ~(mmu->Joypad.select_button);
+			break;
+
+		case SDL_SCANCODE_RETURN:
+		case SDL_SCANCODE_LCTRL:
+		case SDL_SCANCODE_RCTRL:
+			//press start
+			mmu->Joypad.buttons &= ~(mmu->Joypad.start_button);
+			break;
+
+		case SDL_SCANCODE_F1:
+			//cycle through the cgb colour correction modes
+			mmu->SetColorCorrection((Mmu::COLOR_CORRECTION)((mmu->GetColorCorrection() + 1) % Mmu::COLOR_CORRECTION_COUNT));
+			break;
+
+		case SDL_SCANCODE_F2:
+			//toggle dmg frame blending
+			ppu->SetFrameBlending(!ppu->GetFrameBlending());
+			break;
+
+		default:
+			break;
+		}
+		break;
+	}
+	case(SDL_KEYUP):
+	{
+		switch (e.key.keysym.scancode)
+		{
+		case SDL_SCANCODE_W:
+		case SDL_SCANCODE_UP:
+			//release up;
+			mmu->Joypad.directions |= mmu->Joypad.up;
+			break;
+
+		case SDL_SCANCODE_S:
+		case SDL_SCANCODE_DOWN:
+			//release down
+			mmu->Joypad.directions |= mmu->Joypad.down;
+			break;
+
+		case SDL_SCANCODE_A:
+		case SDL_SCANCODE_LEFT:
+			//release left
+			mmu->Joypad.directions |= mmu->Joypad.left;
+			break;
+
+		case SDL_SCANCODE_D:
+		case SDL_SCANCODE_RIGHT:
+			//release right
+			mmu->Joypad.directions |= mmu->Joypad.right;
+			break;
+
+		case SDL_SCANCODE_Z:
+		case SDL_SCANCODE_N:
+			//release B
+			mmu->Joypad.buttons |= mmu->Joypad.b_button;
+			break;
+
+		case SDL_SCANCODE_X:
+		case SDL_SCANCODE_M:
+			//release A
+			mmu->Joypad.buttons |= mmu->Joypad.a_button;
+			break;
+
+		case SDL_SCANCODE_RSHIFT:
+		case SDL_SCANCODE_LSHIFT:
+			//release select
+			mmu->Joypad.buttons |= mmu->Joypad.select_button;
+			break;
+
+		case SDL_SCANCODE_RETURN:
+		case SDL_SCANCODE_LCTRL:
+		case SDL_SCANCODE_RCTRL:
+			//release start
+			mmu->Joypad.buttons |= mmu->Joypad.start_button;
+			break;
+
+		default:
+			break;
+		}
+		break;
+	}
+	case(SDL_CONTROLLERBUTTONDOWN):
+	{
+		uint8_t ifreg = mmu->ReadByteDirect(0xFF0F);
+		if (mmu->ReadByteDirect(0xFF00) & (0x10 || 0x20))
+			mmu->WriteByteDirect(0xFF0F, ifreg | 0x10);
+		switch (e.cbutton.button)
+		{
+		case(SDL_CONTROLLER_BUTTON_A):
+		{
+			//press B
+			mmu->Joypad.buttons &= ~(mmu->Joypad.b_button);
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_B):
+		{
+			//press A
+			mmu->Joypad.buttons &= ~(mmu->Joypad.a_button);
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_START):
+		{
+			//press start
+			mmu->Joypad.buttons &= ~(mmu->Joypad.start_button);
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_BACK):
+		{
+			//press select
+			mmu->Joypad.buttons &= ~(mmu->Joypad.select_button);
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_DPAD_UP):
+		{
+			//press up;
+			mmu->Joypad.directions &= ~(mmu->Joypad.up);
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_DPAD_DOWN):
+		{
+			//press down
+			mmu->Joypad.directions &= ~(mmu->Joypad.down);
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_DPAD_LEFT):
+		{
+			//press left
+			mmu->Joypad.directions &= ~(mmu->Joypad.left);
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_DPAD_RIGHT):
+		{
+			//press right
+			mmu->Joypad.directions &= ~(mmu->Joypad.right);
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_LEFTSHOULDER):
+		{
+			apu->ToggleMute();
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_RIGHTSHOULDER):
+		{
+			double currentThrottle = cpu->GetThrottle();
+			currentThrottle *= 2.0;
+			if (currentThrottle > 4.0)
+				currentThrottle = 1.0;
+			cpu->SetThrottle(currentThrottle);
+			break;
+		}
+		default:
+			break;
+		}
+		break;
+	}
+	case(SDL_CONTROLLERBUTTONUP):
+	{
+		switch (e.cbutton.button)
+		{
+		case(SDL_CONTROLLER_BUTTON_A):
+		{
+			//release B
+			mmu->Joypad.buttons |= mmu->Joypad.b_button;
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_B):
+		{
+			//release A
+			mmu->Joypad.buttons |= mmu->Joypad.a_button;
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_START):
+		{
+			//release start
+			mmu->Joypad.buttons |= mmu->Joypad.start_button;
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_BACK):
+		{
+			//release select
+			mmu->Joypad.buttons |= mmu->Joypad.select_button;
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_DPAD_UP):
+		{
+			//release up;
+			mmu->Joypad.directions |= mmu->Joypad.up;
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_DPAD_DOWN):
+		{
+			//release down
+			mmu->Joypad.directions |= mmu->Joypad.down;
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_DPAD_LEFT):
+		{
+			//release left
+			mmu->Joypad.directions |= mmu->Joypad.left;
+			break;
+		}
+		case(SDL_CONTROLLER_BUTTON_DPAD_RIGHT):
+		{
+			//release right
+			mmu->Joypad.directions |= mmu->Joypad.right;
+			break;
+		}
+		default:
+			break;
+		}
+		break;
+	}
+	case(SDL_CONTROLLERAXISMOTION):
+	{
+		switch (e.caxis.axis)
+		{
+		case(SDL_CONTROLLER_AXIS_LEFTX):
+		{
+			if (e.caxis.value < -8000)
+			{
+				//press left
+				mmu->Joypad.directions &= ~(mmu->Joypad.left);
+				//release right
+				mmu->Joypad.directions |= mmu->Joypad.right;
+			}
+			else if (e.caxis.value > 8000)
+			{
+				//press right
+				mmu->Joypad.directions &= ~(mmu->Joypad.right);
+				//release left
+				mmu->Joypad.directions |= mmu->Joypad.left;
+			}
+			else
+			{
+				//release right
+				mmu->Joypad.directions |= mmu->Joypad.right;
+				//release left
+				mmu->Joypad.directions |= mmu->Joypad.left;
+			}
+			break;
+		}
+		case(SDL_CONTROLLER_AXIS_LEFTY):
+		{
+			if (e.caxis.value < -8000)
+			{
+				//press up
+				mmu->Joypad.directions &= ~(mmu->Joypad.up);
+				//release down
+				mmu->Joypad.directions |= mmu->Joypad.down;
+			}
+			else if (e.caxis.value > 8000)
+			{
+				//press down
+				mmu->Joypad.directions &= ~(mmu->Joypad.down);
+				//release up
+				mmu->Joypad.directions |= mmu->Joypad.up;
+			}
+			else
+			{
+				//release up
+				mmu->Joypad.directions |= mmu->Joypad.up;
+				//release down
+				mmu->Joypad.directions |= mmu->Joypad.down;
+			}
+			break;
+		}
+		default:
+			break;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+//The emulation thread: runs the emulator as the audio device asks for it and takes in main's events between frames.
+//Finished frames go to main through the FrameExchange the ppu was given
+static int EmulateFrames(void* data)
+{
+	Emulation* emulation = (Emulation*)data;
+	while (!emulation->quit)
+	{
+		if (!RunEmulation(emulation->cpu, emulation->mmu, emulation->apu, emulation->linkCable))
+			continue;
+
+		{
+			std::lock_guard<std::mutex> lock(emulation->titleLock);
+			emulation->title = emulation->cpu->titlestream.str();
+		}
+		float rumble = TakeRumble(emulation->mmu);
+		if (rumble > 0.0f)
+			emulation->rumble = rumble;
+
+		while (SDL_Event* e = emulation->events.Front())
+		{
+			HandleEvent(*e, emulation->cpu, emulation->mmu, emulation->ppu, emulation->apu);
+			emulation->events.Pop();
+		}
+	}
+	return 0;
+}
 
 int main(int argc, char* argv[])
 {
@@ -132,7 +634,11 @@ int main(int argc, char* argv[])
 
 	SDL_Window* window;
 
-	SDL_Renderer* renderer;
+	SDL_Renderer* renderer = nullptr;
+
+	SDL_Texture* texture = nullptr;
+
+	FrameExchange* frameExchange = nullptr;
 
 	if (enabledAudio)
 	{
@@ -150,7 +656,8 @@ int main(int argc, char* argv[])
 		SDL_GL_SetSwapInterval(1);
 	}
 
-	SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 160, 144);
+	if (renderer)
+		texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, KGB_STREAMING_TEXTURE ? SDL_TEXTUREACCESS_STREAMING : SDL_TEXTUREACCESS_TARGET, 160, 144);
 	
 	Serial* linkCable{ nullptr };
 
@@ -163,26 +670,17 @@ int main(int argc, char* argv[])
 
 	Mmu* mmu = new Mmu(apu, linkCable);
 
-	std::ifstream inFile;
-	inFile.open(argv[1], std::ios::in | std::ios::binary);
-	inFile.unsetf(std::ios::skipws);
-	inFile.seekg(0, std::ios::end);
-	int fileSize = inFile.tellg();
-	inFile.seekg(0, std::ios::beg);
-
-	fileSize = fileSize < 0x800000 ? fileSize : 0x800000;
-
-	if (!inFile.read((char*)mmu->GetROM(), fileSize))
+	if (!mmu->LoadRom(argv[1]))
 	{
 		std::cerr << "Error reading file." << std::endl;
 		exit(-1);
 	}
-	inFile.close();
 
+	std::ifstream inFile;
 	inFile.open(argv[2], std::ios::in | std::ios::binary);
 	inFile.unsetf(std::ios::skipws);
 	inFile.seekg(0, std::ios::end);
-	fileSize = inFile.tellg();
+	int fileSize = inFile.tellg();
 	inFile.seekg(0, std::ios::beg);
 
 	if (fileSize == 0x100)
@@ -219,486 +717,145 @@ int main(int argc, char* argv[])
 	Ppu* ppu = new Ppu(mmu, texture, renderer);
 	Cpu* cpu = new Cpu(mmu, ppu, apu);
 
-	while (!userQuit)
+	Emulation emulation;
+	SDL_Thread* emulationThread = nullptr;
+#if KGB_EMULATION_THREAD
+	if (apu)
 	{
-		if (linkCable)
-			linkCable->Tick();
-
-		if (apu == nullptr)
+		frameExchange = new FrameExchange();
+		ppu->SetFrameExchange(frameExchange);
+		emulation.cpu = cpu;
+		emulation.mmu = mmu;
+		emulation.ppu = ppu;
+		emulation.apu = apu;
+		emulation.linkCable = linkCable;
+		emulationThread = SDL_CreateThread(EmulateFrames, "kgb emulation", &emulation);
+		if (!emulationThread)
 		{
-			//run one frame
-			do
-			{
-				cpu->Tick();
-			} while (cpu->GetFrameCycles() < (456 * 154) * mmu->DMASpeed);
+			std::cout << "Could not start the emulation thread, running on the main thread instead. SDL_Error: " << SDL_GetError() << std::endl;
+			ppu->SetFrameExchange(nullptr);
+			delete frameExchange;
+			frameExchange = nullptr;
 		}
-		else
+	}
+#endif
+
+	std::string shownTitle;
+	while (!userQuit)
+	{
+		std::string title;
+		float rumble = 0.0f;
+		if (emulationThread)
 		{
-			static double carry_time = 0;
-			
-			//int samples_ready = SDL_AudioStreamAvailable(apu->audio_stream);
-			//if (samples_ready < cpu->audio_frames_requested)
-			SDL_LockAudioDevice(cpu->audio_device);
-			if(cpu->audio_frames_requested > 0)
+			//emulation runs on its own thread, main only shows the newest frame it has published and passes input on
+			const uint32_t* frame = frameExchange->TakeLatest();
+			if (frame)
 			{
-				unsigned int cpu_ticks = cpu->audio_frames_requested;// -samples_ready; //audio frames requested
-				cpu->audio_frames_requested = 0;
-				double accurate_ticks;
-				if (cpu->GetDoubleSpeedMode())
-					accurate_ticks = (double)cpu_ticks * cpu->GetThrottle() * ((double)0x800000 / (double)48000) + carry_time;
-				else
-					accurate_ticks = (double)cpu_ticks * cpu->GetThrottle() * ((double)0x400000 / (double)48000) + carry_time;
-
-
-				uint64_t pre_update_cpu_cycles = cpu->GetTotalCycles();
-				
-				while ((cpu->GetTotalCycles() - pre_update_cpu_cycles) < accurate_ticks) //tick emulator forward and fill audio buffer
-				{
-					uint64_t tick_cycles = cpu->GetTotalCycles();
-					cpu->Tick();
-					tick_cycles = cpu->GetTotalCycles() - tick_cycles;
-
-					cpu->apu->Update(tick_cycles, cpu->GetDoubleSpeedMode());
-				}
-				
-
-				carry_time = (cpu->GetTotalCycles() - pre_update_cpu_cycles) - accurate_ticks;
-				cpu->frame_mus = cpu->watch.elapsed<stopwatch::mus>();
-				cpu->running_frame_times[cpu->frame_time_index] = cpu->frame_mus;
-				cpu->frame_time_index = (cpu->frame_time_index + 1) % 60;
-				
-				cpu->average_cycles_per_frame[cpu->avg_cycles_index] = cpu->GetTotalCycles() - pre_update_cpu_cycles;
-				cpu->avg_cycles_index = (cpu->avg_cycles_index + 1) % 60;
-				
-				if (cpu->title_timer.elapsed<stopwatch::ms>() > 200)
-				{
-					cpu->average_frame_mus = 0;
-					for (int i = 0; i < 60; i++)
-						cpu->average_frame_mus += cpu->running_frame_times[i];
-					cpu->average_frame_mus = cpu->average_frame_mus / 60;
-
-					cpu->avg_cycles = 0;
-					for (int i = 0; i < 60; i++)
-						cpu->avg_cycles += cpu->average_cycles_per_frame[i];
-					cpu->avg_cycles = cpu->avg_cycles / 60;
-
-					cpu->title_timer.start();
-
-					//double fps = ((double)(cpu->GetTotalCycles() - pre_update_cpu_cycles) * 1000000.0) / (70224.0 * ((double)cpu->average_frame_mus));
-					double fps = ((double)(cpu->avg_cycles) * 1000000.0) / (70224.0 * ((double)cpu->average_frame_mus));
-					if (cpu->GetDoubleSpeedMode())
-						fps *= 0.5;
-					cpu->titlestream.str(std::string());
-					//cpu->titlestream.precision(4);// << std::setprecision(4);
-					cpu->titlestream << "KGB    FPS: ";
-					cpu->titlestream << fps;
-				}
-				cpu->watch.start();
+				SDL_RenderClear(renderer);
+				SDL_UpdateTexture(texture, NULL, frame, 4 * 160);
+				SDL_RenderCopy(renderer, texture, NULL, NULL);
+				SDL_RenderPresent(renderer);
+			}
+			else
+				SDL_Delay(1);
 
+			{
+				std::lock_guard<std::mutex> lock(emulation.titleLock);
+				title = emulation.title;
 			}
-			SDL_UnlockAudioDevice(cpu->audio_device);
+			rumble = emulation.rumble.exchange(0.0f);
 		}
-		
-		if (cpu->GetFrameCycles() > (456 * 154) * mmu->DMASpeed)
+		else
 		{
-			cpu->SetFrameCycles(cpu->GetFrameCycles() - ((456 * 154) * mmu->DMASpeed));
+			if (!RunEmulation(cpu, mmu, apu, linkCable))
+				continue;
+			title = cpu->titlestream.str();
+			rumble = TakeRumble(mmu);
+		}
 
-			SDL_SetWindowTitle(window, cpu->titlestream.str().c_str());
+		if (title != shownTitle)
+		{
+			SDL_SetWindowTitle(window, title.c_str());
+			shownTitle = title;
+		}
 
-			if (enableControllerHaptic)
+		if (enableControllerHaptic && rumble > 0.0f)
+		{
+			//Play rumble at the strength the game asked for, for 250 milliseconds
+			if (SDL_HapticRumblePlay(controllerHaptic, rumble, 250) != 0)
 			{
-				if (mmu->rumbleStrength)
-				{
-					//Play rumble at 75% strenght for 500 milliseconds
-					if (SDL_HapticRumblePlay(controllerHaptic, (double)mmu->rumbleStrength / (double)((456 * 154) * mmu->DMASpeed), 250) != 0)
-					{
-						printf("Warning: Unable to play rumble! %s\n", SDL_GetError());
-					}
-					mmu->rumbleStrength = 0;
-				}
-				//else
-				//{
-				//	SDL_HapticStopAll(controllerHaptic);
-				//}
+				printf("Warning: Unable to play rumble! %s\n", SDL_GetError());
 			}
+		}
 
-			//SDL events to close window
-			while (SDL_PollEvent(&e))
+		//SDL events to close window
+		while (SDL_PollEvent(&e))
+		{
+			switch (e.type)
 			{
-				switch (e.type)
-				{
-				case(SDL_QUIT):
-				{
-					userQuit = true;
-					break;
-				}
-				case(SDL_WINDOWEVENT):
-				{
-					switch (e.window.event)
-					{
-					case(SDL_WINDOWEVENT_MOVED):
-					{
-						if (cpu->apu)
-						{
-							SDL_LockAudioDevice(cpu->audio_device);
-							SDL_AudioStreamClear(cpu->apu->audio_stream);
-							SDL_ClearQueuedAudio(cpu->audio_device);
-							cpu->audio_frames_requested = 0;
-							SDL_UnlockAudioDevice(cpu->audio_device);
-						}
-						break;
-					}
-					default:
-						break;
-					}
-					break;
-				}
-				case(SDL_KEYDOWN):
-				{
-					uint8_t ifreg = mmu->ReadByteDirect(0xFF0F);
-					if (mmu->ReadByteDirect(0xFF00) & (0x10 || 0x20))
-						mmu->WriteByteDirect(0xFF0F, ifreg | 0x10);
-					switch (e.key.keysym.scancode)
-					{
-					case SDL_SCANCODE_W:
-					case SDL_SCANCODE_UP:
-						//press up;
-						mmu->Joypad.directions &= ~(mmu->Joypad.up);
-						break;
-
-					case SDL_SCANCODE_S:
-					case SDL_SCANCODE_DOWN:
-						//press down
-						mmu->Joypad.directions &= ~(mmu->Joypad.down);
-						break;
-
-					case SDL_SCANCODE_A:
-					case SDL_SCANCODE_LEFT:
-						//press left
-						mmu->Joypad.directions &= ~(mmu->Joypad.left);
-						break;
-
-					case SDL_SCANCODE_D:
-					case SDL_SCANCODE_RIGHT:
-						//press right
-						mmu->Joypad.directions &= ~(mmu->Joypad.right);
-						break;
-
-					case SDL_SCANCODE_Z:
-					case SDL_SCANCODE_N:
-						//press B
-						mmu->Joypad.buttons &= ~(mmu->Joypad.b_button);
-						break;
-
-					case SDL_SCANCODE_X:
-					case SDL_SCANCODE_M:
-						//press A
-						mmu->Joypad.buttons &= ~(mmu->Joypad.a_button);
-						break;
-
-					case SDL_SCANCODE_RSHIFT:
-					case SDL_SCANCODE_LSHIFT:
-						//press select
-						mmu->Joypad.buttons &= ~(mmu->Joypad.select_button);
-						break;
-
-					case SDL_SCANCODE_RETURN:
-					case SDL_SCANCODE_LCTRL:
-					case SDL_SCANCODE_RCTRL:
-						//press start
-						mmu->Joypad.buttons &= ~(mmu->Joypad.start_button);
-						break;
-
-					default:
-						break;
-					}
-					break;
-				}
-				case(SDL_KEYUP):
-				{
-					switch (e.key.keysym.scancode)
-					{
-					case SDL_SCANCODE_W:
-					case SDL_SCANCODE_UP:
-						//release up;
-						mmu->Joypad.directions |= mmu->Joypad.up;
-						break;
-
-					case SDL_SCANCODE_S:
-					case SDL_SCANCODE_DOWN:
-						//release down
-						mmu->Joypad.directions |= mmu->Joypad.down;
-						break;
-
-					case SDL_SCANCODE_A:
-					case SDL_SCANCODE_LEFT:
-						//release left
-						mmu->Joypad.directions |= mmu->Joypad.left;
-						break;
-
-					case SDL_SCANCODE_D:
-					case SDL_SCANCODE_RIGHT:
-						//release right
-						mmu->Joypad.directions |= mmu->Joypad.right;
-						break;
-
-					case SDL_SCANCODE_Z:
-					case SDL_SCANCODE_N:
-						//release B
-						mmu->Joypad.buttons |= mmu->Joypad.b_button;
-						break;
-
-					case SDL_SCANCODE_X:
-					case SDL_SCANCODE_M:
-						//release A
-						mmu->Joypad.buttons |= mmu->Joypad.a_button;
-						break;
-
-					case SDL_SCANCODE_RSHIFT:
-					case SDL_SCANCODE_LSHIFT:
-						//release select
-						mmu->Joypad.buttons |= mmu->Joypad.select_button;
-						break;
-
-					case SDL_SCANCODE_RETURN:
-					case SDL_SCANCODE_LCTRL:
-					case SDL_SCANCODE_RCTRL:
-						//release start
-						mmu->Joypad.buttons |= mmu->Joypad.start_button;
-						break;
-
-					default:
-						break;
-					}
-					break;
-				}
-				case(SDL_CONTROLLERBUTTONDOWN):
-				{
-					uint8_t ifreg = mmu->ReadByteDirect(0xFF0F);
-					if (mmu->ReadByteDirect(0xFF00) & (0x10 || 0x20))
-						mmu->WriteByteDirect(0xFF0F, ifreg | 0x10);
-					switch (e.cbutton.button)
-					{
-					case(SDL_CONTROLLER_BUTTON_A):
-					{
-						//press B
-						mmu->Joypad.buttons &= ~(mmu->Joypad.b_button);
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_B):
-					{
-						//press A
-						mmu->Joypad.buttons &= ~(mmu->Joypad.a_button);
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_START):
-					{
-						//press start
-						mmu->Joypad.buttons &= ~(mmu->Joypad.start_button);
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_BACK):
-					{
-						//press select
-						mmu->Joypad.buttons &= ~(mmu->Joypad.select_button);
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_DPAD_UP):
-					{
-						//press up;
-						mmu->Joypad.directions &= ~(mmu->Joypad.up);
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_DPAD_DOWN):
-					{
-						//press down
-						mmu->Joypad.directions &= ~(mmu->Joypad.down);
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_DPAD_LEFT):
-					{
-						//press left
-						mmu->Joypad.directions &= ~(mmu->Joypad.left);
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_DPAD_RIGHT):
-					{
-						//press right
-						mmu->Joypad.directions &= ~(mmu->Joypad.right);
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_LEFTSHOULDER):
-					{
-						apu->ToggleMute();
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_RIGHTSHOULDER):
-					{
-						double currentThrottle = cpu->GetThrottle();
-						currentThrottle *= 2.0;
-						if (currentThrottle > 4.0)
-							currentThrottle = 1.0;
-						cpu->SetThrottle(currentThrottle);
-						break;
-					}
-					default:
-						break;
-					}
-					break;
-				}
-				case(SDL_CONTROLLERBUTTONUP):
-				{
-					switch (e.cbutton.button)
-					{
-					case(SDL_CONTROLLER_BUTTON_A):
-					{
-						//release B
-						mmu->Joypad.buttons |= mmu->Joypad.b_button;
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_B):
-					{
-						//release A
-						mmu->Joypad.buttons |= mmu->Joypad.a_button;
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_START):
-					{
-						//release start
-						mmu->Joypad.buttons |= mmu->Joypad.start_button;
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_BACK):
-					{
-						//release select
-						mmu->Joypad.buttons |= mmu->Joypad.select_button;
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_DPAD_UP):
-					{
-						//release up;
-						mmu->Joypad.directions |= mmu->Joypad.up;
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_DPAD_DOWN):
-					{
-						//release down
-						mmu->Joypad.directions |= mmu->Joypad.down;
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_DPAD_LEFT):
-					{
-						//release left
-						mmu->Joypad.directions |= mmu->Joypad.left;
-						break;
-					}
-					case(SDL_CONTROLLER_BUTTON_DPAD_RIGHT):
-					{
-						//release right
-						mmu->Joypad.directions |= mmu->Joypad.right;
-						break;
-					}
-					default:
-						break;
-					}
-					break;
-				}
-				case(SDL_CONTROLLERAXISMOTION):
-				{
-					switch (e.caxis.axis)
-					{
-					case(SDL_CONTROLLER_AXIS_LEFTX):
-					{
-						if (e.caxis.value < -8000)
-						{
-							//press left
-							mmu->Joypad.directions &= ~(mmu->Joypad.left);
-							//release right
-							mmu->Joypad.directions |= mmu->Joypad.right;
-						}
-						else if (e.caxis.value > 8000)
-						{
-							//press right
-							mmu->Joypad.directions &= ~(mmu->Joypad.right);
-							//release left
-							mmu->Joypad.directions |= mmu->Joypad.left;
-						}
-						else
-						{
-							//release right
-							mmu->Joypad.directions |= mmu->Joypad.right;
-							//release left
-							mmu->Joypad.directions |= mmu->Joypad.left;
-						}
-						break;
-					}
-					case(SDL_CONTROLLER_AXIS_LEFTY):
-					{
-						if (e.caxis.value < -8000)
-						{
-							//press up
-							mmu->Joypad.directions &= ~(mmu->Joypad.up);
-							//release down
-							mmu->Joypad.directions |= mmu->Joypad.down;
-						}
-						else if (e.caxis.value > 8000)
-						{
-							//press down
-							mmu->Joypad.directions &= ~(mmu->Joypad.down);
-							//release up
-							mmu->Joypad.directions |= mmu->Joypad.up;
+			case(SDL_QUIT):
+			{
+				userQuit = true;
+				break;
+			}
+			case(SDL_CONTROLLERDEVICEREMOVED):
+			{
+				for (int i = 0; i < SDL_NumJoysticks(); ++i) {
+					if (SDL_IsGameController(i)) {
+						controller = SDL_GameControllerOpen(i);
+						if (controller) {
+							break;
 						}
-						else
-						{
-							//release up
-							mmu->Joypad.directions |= mmu->Joypad.up;
-							//release down
-							mmu->Joypad.directions |= mmu->Joypad.down;
+						else {
+							std::cout << "Could not open gamecontroller " << i << ". " << SDL_GetError() << std::endl;
 						}
-						break;
-					}
-					default:
-						break;
 					}
-					break;
 				}
-				case(SDL_CONTROLLERDEVICEREMOVED):
-				{
-					for (int i = 0; i < SDL_NumJoysticks(); ++i) {
-						if (SDL_IsGameController(i)) {
-							controller = SDL_GameControllerOpen(i);
-							if (controller) {
-								break;
-							}
-							else {
-								std::cout << "Could not open gamecontroller " << i << ". " << SDL_GetError() << std::endl;
-							}
+				break;
+			}
+			case(SDL_CONTROLLERDEVICEADDED):
+			{
+				for (int i = 0; i < SDL_NumJoysticks(); ++i) {
+					if (SDL_IsGameController(i)) {
+						controller = SDL_GameControllerOpen(i);
+						if (controller) {
+							break;
 						}
-					}
-					break;
-				}
-				case(SDL_CONTROLLERDEVICEADDED):
-				{
-					for (int i = 0; i < SDL_NumJoysticks(); ++i) {
-						if (SDL_IsGameController(i)) {
-							controller = SDL_GameControllerOpen(i);
-							if (controller) {
-								break;
-							}
-							else {
-								std::cout << "Could not open gamecontroller " << i << ". " << SDL_GetError() << std::endl;
-							}
+						else {
+							std::cout << "Could not open gamecontroller " << i << ". " << SDL_GetError() << std::endl;
 						}
 					}
-					break;
 				}
-				default:
-					break;
+				break;
+			}
+			case(SDL_WINDOWEVENT):
+			case(SDL_KEYDOWN):
+			case(SDL_KEYUP):
+			case(SDL_CONTROLLERBUTTONDOWN):
+			case(SDL_CONTROLLERBUTTONUP):
+			case(SDL_CONTROLLERAXISMOTION):
+			{
+				//with the emulation thread these wait in its queue until its current frame is done
+				if (!emulationThread)
+					HandleEvent(e, cpu, mmu, ppu, apu);
+				else
+				{
+					while (!emulation.events.Push(e))
+						SDL_Delay(1);
 				}
+				break;
+			}
+			default:
+				break;
 			}
 		}
 	}
 
+	if (emulationThread)
+	{
+		emulation.quit = true;
+		SDL_WaitThread(emulationThread, nullptr);
+	}
 	mmu->SaveGame(romFileName);
 	if (enableControllerHaptic)
 	{